@@ -2,8 +2,25 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <sstream>
 #include <deque>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <list>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 using namespace std;
 
 
@@ -26,11 +43,213 @@ struct Reference{
 };
 
 
+//=== Binary reference trace format ===
+//	Header:		"MMTR", version, number of processes
+//	Process:	pid, reference count, block count, then one index entry per block
+//				(file offset, first reference, reference count, byte length)
+//	Block:		one varint per reference holding (zigzag(addr - previous addr) << 1) | W.
+//				The previous address restarts at 0 in every block, so blocks decode independently
+//				and can be seeked to or split across readers through the index.
+const char TRACE_MAGIC[4] = { 'M', 'M', 'T', 'R' };
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_BLOCK_REFS = 65536;
+const size_t TRACE_INDEX_ENTRY_SIZE = 8 + 8 + 4 + 4;
+
+struct TraceBlock{
+	uint64_t fileOffset, firstRef;
+	uint32_t refCount, byteLength;
+};
+
+//Packs a reference into a single word with the R/W bit in the lowest bit
+inline uint64_t packReference( int addr, char type ){ return ( uint64_t(uint32_t(addr)) << 1 ) | ( type == 'W' ? 1 : 0 ); }
+inline int unpackAddress( uint64_t word ){ return int( uint32_t(word >> 1) ); }
+inline char unpackType( uint64_t word ){ return (word & 1) ? 'W' : 'R'; }
+
+//Little endian fixed width and varint writers
+void writeU32( vector<unsigned char>& out, uint32_t value ){
+	for( int i = 0; i < 4; ++i ){ out.push_back( (unsigned char)(value >> (8*i)) ); }
+}
+
+void writeU64( vector<unsigned char>& out, uint64_t value ){
+	for( int i = 0; i < 8; ++i ){ out.push_back( (unsigned char)(value >> (8*i)) ); }
+}
+
+void writeVarint( vector<unsigned char>& out, uint64_t value ){
+	while( value >= 0x80 ){
+		out.push_back( (unsigned char)(value | 0x80) );
+		value >>= 7;
+	}
+	out.push_back( (unsigned char)value );
+}
+
+void patchU64( vector<unsigned char>& out, size_t pos, uint64_t value ){
+	for( int i = 0; i < 8; ++i ){ out[pos + i] = (unsigned char)(value >> (8*i)); }
+}
+
+uint32_t readU32( const unsigned char* p ){
+	return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+uint64_t readU64( const unsigned char* p ){
+	return uint64_t( readU32(p) ) | ( uint64_t( readU32(p + 4) ) << 32 );
+}
+
+
+//Encodes one block of packed references
+void encodeTraceBlock( const uint64_t* words, uint32_t count, vector<unsigned char>& out ){
+	int64_t previous = 0;
+	for( uint32_t i = 0; i < count; ++i ){
+		int64_t addr = int64_t( words[i] >> 1 );
+		int64_t delta = addr - previous;
+		uint64_t zigzag = ( uint64_t(delta) << 1 ) ^ uint64_t( delta >> 63 );
+		writeVarint( out, (zigzag << 1) | (words[i] & 1) );
+		previous = addr;
+	}
+}
+
+
+//Decodes one block into packed references. Returns false if the block is truncated
+bool decodeTraceBlock( const unsigned char* data, size_t length, uint32_t count, uint64_t* words ){
+	const unsigned char* end = data + length;
+	int64_t previous = 0;
+	for( uint32_t i = 0; i < count; ++i ){
+		uint64_t value = 0;
+		int shift = 0;
+
+		//Single byte fast path covers small strides
+		if( data < end && *data < 0x80 ){ value = *data++; }
+		else{
+			while( true ){
+				if( data >= end || shift > 63 ){ return false; }
+				unsigned char byte = *data++;
+				value |= uint64_t(byte & 0x7F) << shift;
+				if( byte < 0x80 ){ break; }
+				shift += 7;
+			}
+		}
+
+		uint64_t zigzag = value >> 1;
+		int64_t delta = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+		previous += delta;
+		words[i] = ( uint64_t(previous) << 1 ) | (value & 1);
+	}
+	return true;
+}
+
+
+//Encodes every process trace into a complete binary trace file image
+void encodeTraceFile( vector<int>& pids, vector< vector<uint64_t> >& traces, vector<unsigned char>& out ){
+	out.insert( out.end(), TRACE_MAGIC, TRACE_MAGIC + 4 );
+	writeU32( out, TRACE_VERSION );
+	writeU32( out, uint32_t(pids.size()) );
+
+	for( size_t p = 0; p < pids.size(); ++p ){
+		vector<uint64_t>& words = traces[p];
+		uint32_t blockCount = uint32_t( (words.size() + TRACE_BLOCK_REFS - 1) / TRACE_BLOCK_REFS );
+
+		writeU32( out, uint32_t(pids[p]) );
+		writeU64( out, words.size() );
+		writeU32( out, blockCount );
+
+		//Reserve the index, then fill it in once each block's position is known
+		size_t indexPos = out.size();
+		out.resize( out.size() + blockCount * TRACE_INDEX_ENTRY_SIZE );
+
+		for( uint32_t b = 0; b < blockCount; ++b ){
+			uint64_t firstRef = uint64_t(b) * TRACE_BLOCK_REFS;
+			uint32_t refCount = uint32_t( min<uint64_t>( TRACE_BLOCK_REFS, words.size() - firstRef ) );
+			size_t blockStart = out.size();
+			encodeTraceBlock( &words[firstRef], refCount, out );
+
+			size_t entry = indexPos + b * TRACE_INDEX_ENTRY_SIZE;
+			patchU64( out, entry, blockStart );
+			patchU64( out, entry + 8, firstRef );
+			for( int i = 0; i < 4; ++i ){
+				out[entry + 16 + i] = (unsigned char)(refCount >> (8*i));
+				out[entry + 20 + i] = (unsigned char)(uint32_t(out.size() - blockStart) >> (8*i));
+			}
+		}
+	}
+}
+
+
+//Reads the block index of the process section starting at pos. Returns the position after the section,
+//or 0 if the index is malformed. The blocks have to cover [0, refCount) in order and sit back to back
+//right after the index, and every reference takes at least one byte, so refCount can't claim more
+//references than the section's own bytes hold
+size_t readTraceIndex( const vector<unsigned char>& file, size_t pos, int& pid, uint64_t& refCount, vector<TraceBlock>& blocks ){
+	if( pos + 16 > file.size() ){ return 0; }
+	pid = int( readU32(&file[pos]) );
+	refCount = readU64( &file[pos + 4] );
+	uint32_t blockCount = readU32( &file[pos + 12] );
+	pos += 16;
+
+	if( pos + uint64_t(blockCount) * TRACE_INDEX_ENTRY_SIZE > file.size() ){ return 0; }
+	size_t sectionEnd = pos + blockCount * TRACE_INDEX_ENTRY_SIZE;
+	blocks.clear();
+	uint64_t nextRef = 0;
+	for( uint32_t b = 0; b < blockCount; ++b, pos += TRACE_INDEX_ENTRY_SIZE ){
+		TraceBlock block;
+		block.fileOffset = readU64( &file[pos] );
+		block.firstRef = readU64( &file[pos + 8] );
+		block.refCount = readU32( &file[pos + 16] );
+		block.byteLength = readU32( &file[pos + 20] );
+		if( block.fileOffset != sectionEnd || block.byteLength > file.size() - sectionEnd ){ return 0; }
+		if( block.firstRef != nextRef || block.refCount > block.byteLength || block.refCount > refCount - nextRef ){ return 0; }
+		nextRef += block.refCount;
+		sectionEnd += block.byteLength;
+		blocks.push_back( block );
+	}
+	if( nextRef != refCount ){ return 0; }
+	return sectionEnd;
+}
+
+
+//Returns true if the file starts with the binary trace magic
+bool isBinaryTraceFile( string& fileName ){
+	ifstream file( fileName.c_str(), ios::binary );
+	char magic[4];
+	return file.read( magic, 4 ) && memcmp( magic, TRACE_MAGIC, 4 ) == 0;
+}
+
+
+//Loads and decodes a whole binary trace file. Returns false on a malformed file
+bool decodeTraceFile( string& fileName, vector<int>& pids, vector< vector<uint64_t> >& traces ){
+	ifstream file( fileName.c_str(), ios::binary );
+	if( !file ){ return false; }
+	file.seekg( 0, ios::end );
+	vector<unsigned char> data( (size_t)file.tellg() );
+	file.seekg( 0, ios::beg );
+	if( data.size() > 0 ){ file.read( (char*)&data[0], data.size() ); }
+	if( data.size() < 12 || memcmp( &data[0], TRACE_MAGIC, 4 ) != 0 || readU32(&data[4]) != TRACE_VERSION ){ return false; }
+
+	uint32_t numOfProcesses = readU32( &data[8] );
+	size_t pos = 12;
+	vector<TraceBlock> blocks;
+	for( uint32_t p = 0; p < numOfProcesses; ++p ){
+		int pid;
+		uint64_t refCount;
+		pos = readTraceIndex( data, pos, pid, refCount, blocks );
+		if( pos == 0 ){ return false; }
+
+		pids.push_back( pid );
+		traces.push_back( vector<uint64_t>() );
+		vector<uint64_t>& words = traces.back();
+		words.resize( (size_t)refCount );
+		for( size_t b = 0; b < blocks.size(); ++b ){
+			if( !decodeTraceBlock( &data[size_t(blocks[b].fileOffset)], blocks[b].byteLength, blocks[b].refCount, &words[size_t(blocks[b].firstRef)] ) ){ return false; }
+		}
+	}
+	return true;
+}
+
+
 struct PageTableEntry{
 	bool validBit, dirtyBit, refBit;
+	bool shared;	//Page is mapped from a frame shared with other processes until this process writes to it
 	int pid, addr, offset, page, frame;
 	PageTableEntry( bool validBit, bool dirtyBit, bool refBit, int pid, int addr, int offset, int page ) 
-		: validBit(validBit), dirtyBit(dirtyBit), refBit(refBit), pid(pid), addr(addr), offset(offset), page(page) {}
+		: validBit(validBit), dirtyBit(dirtyBit), refBit(refBit), shared(false), pid(pid), addr(addr), offset(offset), page(page) {}
 };
 
 
@@ -46,18 +265,80 @@ struct PageTable{
 };
 
 
+//Returns the index of the lowest set bit of a non-zero word
+inline int lowestSetBit( uint64_t word ){
+#ifdef _MSC_VER
+	unsigned long index;
+	if( _BitScanForward( &index, (unsigned long)word ) ){ return int(index); }
+	_BitScanForward( &index, (unsigned long)(word >> 32) );
+	return int(index) + 32;
+#else
+	return __builtin_ctzll( word );
+#endif
+}
+
+
+//One bit per frame, packed 64 frames to a word
+struct FrameBits{
+	int size;
+	vector<uint64_t> words;
+
+	FrameBits( int size ) : size(size), words( (size + 63) / 64, 0 ) {}
+
+	bool test( size_t i ){ return ( words[i/64] >> (i%64) ) & 1; }
+	void set( size_t i ){ words[i/64] |= uint64_t(1) << (i%64); }
+	void clear( size_t i ){ words[i/64] &= ~( uint64_t(1) << (i%64) ); }
+	void assign( size_t i, bool value ){ if( value ){ set(i); } else{ clear(i); } }
+
+	//Mask of the bits in the given word that belong to real frames
+	uint64_t wordMask( size_t wordIndex ){
+		if( (wordIndex+1)*64 <= size_t(size) ){ return ~uint64_t(0); }
+		return ( uint64_t(1) << (size % 64) ) - 1;
+	}
+
+	//Returns the first set bit at or after 'from', or -1 if there isn't one
+	int findNext( size_t from ){
+		if( from >= size_t(size) ){ return -1; }
+		size_t wordIndex = from / 64;
+		uint64_t word = words[wordIndex] & (~uint64_t(0) << (from % 64));
+		while( word == 0 ){
+			if( ++wordIndex >= words.size() ){ return -1; }
+			word = words[wordIndex];
+		}
+		return int( wordIndex*64 + lowestSetBit(word) );
+	}
+
+	//Clears the bits in [first, last)
+	void clearRange( size_t first, size_t last ){
+		while( first < last && first % 64 != 0 ){ clear( first++ ); }
+		while( first + 64 <= last ){ words[first/64] = 0; first += 64; }
+		while( first < last ){ clear( first++ ); }
+	}
+};
+
+
 class Process{
 private:
 	int pid, arrivalTime, waitTime, pageSize, vaSize, currentRef;
 	deque<Reference*> references;
 	PageTable* pageTable;
+	map< int, vector<PageTableEntry*> > pageEntries;	//Every reference to each page, so a fault can map them all at once
+	set<int> prefetched;								//Pages read ahead that haven't been used yet
+	int lastFaultPage, stride, window;					//Read-ahead stream detection
+	deque<int> recentPages;								//Sliding window of the last references, for the working set
+	map<int, int> recentCounts;							//How many times each page shows up in that window
+	int referencesSinceFault;
+	map< int, set<int> > regionTouches;					//Distinct faulted pages in each huge page region
 
 public:
 	Process( int pid, int arrivalTime, int pageSize, int vaSize, deque<Reference*>& references )
-		: pid(pid), arrivalTime(arrivalTime), waitTime(0), pageSize(pageSize), vaSize(vaSize), currentRef(0), references(references) {
+		: pid(pid), arrivalTime(arrivalTime), waitTime(0), pageSize(pageSize), vaSize(vaSize), currentRef(0), references(references),
+		  lastFaultPage(-1), stride(0), window(0), referencesSinceFault(0) {
 
-		//Initialize process' page table
-		pageTable = new PageTable( pow(2, vaSize)/pageSize );
+		//Initialize process' page table (Long traces need at least one entry per reference)
+		int tableSize = int( pow(2, vaSize)/pageSize );
+		if( tableSize < int(references.size()) ){ tableSize = int(references.size()); }
+		pageTable = new PageTable( tableSize );
 
 		//Map all references in the process' page table
 		for( int i = 0; i < references.size(); ++i ){
@@ -65,10 +346,21 @@ public:
 			int offset = references[i]->addr%pageSize;
 			bool dirtyBit = (references[i]->type == 'W') ? true : false;
 			pageTable->pages[i] = new PageTableEntry( 0, dirtyBit, 0, pid, references[i]->addr, offset, pageNum );
+			pageEntries[pageNum].push_back( pageTable->pages[i] );
 		}
 	}
 
 
+	//Every entry of the page table is also in pageEntries, along with the placeholders
+	~Process(){
+		for( map< int, vector<PageTableEntry*> >::iterator it = pageEntries.begin(); it != pageEntries.end(); ++it ){
+			for( size_t i = 0; i < it->second.size(); ++i ){ delete it->second[i]; }
+		}
+		for( size_t i = 0; i < references.size(); ++i ){ delete references[i]; }
+		delete pageTable;
+	}
+
+
 	//Return process id
 	int getPID(){ return pid; }		
 
@@ -99,6 +391,104 @@ public:
 	//Return the table
 	PageTable* getPageTable(){ return pageTable; }
 
+	//Return the number of pages in the process' virtual address space
+	int getPageCount(){ return int( pow(2, vaSize)/pageSize ); }
+
+	//Returns an entry that stands for the whole page. Pages the trace never touches get a placeholder
+	PageTableEntry* getPageEntry( int page ){
+		vector<PageTableEntry*>& entries = pageEntries[page];
+		if( entries.empty() ){ entries.push_back( new PageTableEntry( 0, 0, 0, pid, page*pageSize, 0, page ) ); }
+		return entries[0];
+	}
+
+	//Read-ahead state accessors
+	int getLastFaultPage(){ return lastFaultPage; }
+	int getStride(){ return stride; }
+	int getWindow(){ return window; }
+	void setReadAhead( int page, int newStride, int newWindow ){ lastFaultPage = page; stride = newStride; window = newWindow; }
+
+	//Remember a page that was brought in ahead of time
+	void markPrefetched( int page ){ prefetched.insert( page ); }
+
+	//Forgets the page if it was prefetched. Returns true if it was
+	bool takePrefetched( int page ){ return !prefetched.empty() && prefetched.erase( page ) > 0; }
+
+	//Returns the number of prefetched pages that were never used
+	size_t pendingPrefetches(){ return prefetched.size(); }
+
+	//Adds a completed reference to the working set window
+	void recordReference( int page, int windowSize ){
+		recentPages.push_back( page );
+		recentCounts[page]++;
+		if( int(recentPages.size()) > windowSize ){
+			int oldest = recentPages.front();
+			recentPages.pop_front();
+			if( --recentCounts[oldest] == 0 ){ recentCounts.erase( oldest ); }
+		}
+		referencesSinceFault++;
+	}
+
+	//Returns the number of distinct pages in the working set window
+	int getWorkingSetSize(){ return int( recentCounts.size() ); }
+
+	//Returns the number of references since the last fault and starts counting again
+	int takeFaultInterval(){
+		int interval = referencesSinceFault;
+		referencesSinceFault = 0;
+		return interval;
+	}
+
+	//Marks every reference to the given pages as shared with other processes
+	void markSharedPages( set<int>& sharedPages ){
+		for( set<int>::iterator it = sharedPages.begin(); it != sharedPages.end(); ++it ){
+			map< int, vector<PageTableEntry*> >::iterator found = pageEntries.find( *it );
+			if( found == pageEntries.end() ){ continue; }
+			for( size_t i = 0; i < found->second.size(); ++i ){ found->second[i]->shared = true; }
+		}
+	}
+
+	//After copy-on-write the page belongs to this process alone
+	void privatizePage( int page ){
+		vector<PageTableEntry*>& entries = pageEntries[page];
+		for( size_t i = 0; i < entries.size(); ++i ){ entries[i]->shared = false; }
+	}
+
+	//Records a faulted page against its huge page region. Returns how many distinct pages of the region have faulted
+	int touchRegion( int page, int ratio ){
+		set<int>& touched = regionTouches[page/ratio];
+		touched.insert( page );
+		return int( touched.size() );
+	}
+
+	//Starts counting the region's faults over (after it was promoted)
+	void resetRegion( int region ){ regionTouches.erase( region ); }
+
+	//Collects an entry for every page of the region in page order. Returns false if any of them is shared
+	bool getRegionEntries( int region, int ratio, vector<PageTableEntry*>& entries ){
+		for( int i = 0; i < ratio; ++i ){
+			entries.push_back( getPageEntry( region*ratio + i ) );
+			if( entries.back()->shared ){ return false; }
+		}
+		return true;
+	}
+
+	//Swapped out: every page has to fault back in, and read-ahead that was never used is gone
+	void invalidatePages(){
+		for( map< int, vector<PageTableEntry*> >::iterator it = pageEntries.begin(); it != pageEntries.end(); ++it ){
+			for( size_t i = 0; i < it->second.size(); ++i ){ it->second[i]->validBit = 0; }
+		}
+		prefetched.clear();
+	}
+
+	//Notifies every reference of the given page that it has a spot in physical memory now
+	void mapPage( int page, int frame ){
+		vector<PageTableEntry*>& entries = pageEntries[page];
+		for( size_t i = 0; i < entries.size(); ++i ){
+			entries[i]->validBit = 1;
+			entries[i]->frame = frame;
+		}
+	}
+
 	//Return the deque of references (Used for display tests)
 	deque<Reference*> getReferences(){ return references; }
 
@@ -119,76 +509,663 @@ public:
 };
 
 
+//Compressed in-memory swap tier (like zswap) between the frames and the backing store.
+//Evicted pages are compressed into a pool of 'capacity' bytes. A page's compressed size is
+//pageSize/ratio scaled by a per-page factor between 0.5 and 1.5, so some pages compress
+//better than others. Pages that don't shrink go straight to the backing store. When the
+//pool is full the oldest pages are spilled, and the dirty ones among them have to be written.
+class CompressedPool{
+private:
+	struct StoredPage{
+		int size;
+		bool dirty;
+		list< pair<int, int> >::iterator age;
+	};
+
+	int capacity, pageSize, usedBytes;
+	double ratio;
+	map< pair<int, int>, StoredPage > stored;		//(pid, page) -> compressed copy
+	list< pair<int, int> > ages;					//Oldest first
+	int pendingWrites;								//Dirty spills not yet charged to a faulting process
+	uint64_t stores, loads, spills, dirtySpills, rejected;
+	int peakPages, peakBytes;
+
+public:
+	CompressedPool( int capacity, int pageSize, double ratio )
+		: capacity(capacity), pageSize(pageSize), usedBytes(0), ratio(ratio), pendingWrites(0),
+		  stores(0), loads(0), spills(0), dirtySpills(0), rejected(0), peakPages(0), peakBytes(0) {}
+
+	//Deterministic compressed size of a page
+	int compressedSize( int pid, int page ){
+		uint32_t hash = uint32_t(pid) * 2654435761u ^ uint32_t(page) * 40503u;
+		hash ^= hash >> 15;
+		hash *= 2246822519u;
+		hash ^= hash >> 13;
+		double factor = 0.5 + (hash % 1000) / 1000.0;
+		return min( pageSize, max( 1, int( pageSize / ratio * factor ) ) );
+	}
+
+	//Forgets a stored page
+	void erase( map< pair<int, int>, StoredPage >::iterator found ){
+		usedBytes -= found->second.size;
+		ages.erase( found->second.age );
+		stored.erase( found );
+	}
+
+	//Removes the oldest page, writing it to the backing store if it's dirty
+	void spillOldest(){
+		map< pair<int, int>, StoredPage >::iterator oldest = stored.find( ages.front() );
+		if( oldest->second.dirty ){ dirtySpills++; pendingWrites++; }
+		erase( oldest );
+		spills++;
+	}
+
+	//Compresses an evicted page into the pool. Returns false if it didn't compress and has to go to the backing store
+	bool store( int pid, int page, bool dirty ){
+		int size = compressedSize( pid, page );
+		if( size >= pageSize || size > capacity ){ rejected++; return false; }
+
+		//A stale copy is replaced. Its changes are still unwritten if it was dirty
+		map< pair<int, int>, StoredPage >::iterator old = stored.find( make_pair(pid, page) );
+		if( old != stored.end() ){
+			dirty = dirty || old->second.dirty;
+			erase( old );
+		}
+
+		while( usedBytes + size > capacity ){ spillOldest(); }
+		StoredPage entry;
+		entry.size = size;
+		entry.dirty = dirty;
+		entry.age = ages.insert( ages.end(), make_pair(pid, page) );
+		stored[make_pair(pid, page)] = entry;
+		usedBytes += size;
+		stores++;
+
+		peakPages = max( peakPages, int(stored.size()) );
+		peakBytes = max( peakBytes, usedBytes );
+		return true;
+	}
+
+	//Decompresses a page if the pool has it. Returns true if it did, and whether the page
+	//still has changes the backing store doesn't
+	bool load( int pid, int page, bool& dirty ){
+		map< pair<int, int>, StoredPage >::iterator found = stored.find( make_pair(pid, page) );
+		if( found == stored.end() ){ return false; }
+		dirty = found->second.dirty;
+		erase( found );
+		loads++;
+		return true;
+	}
+
+	//Drops every page of a process that's gone
+	void dropPID( int pid ){
+		map< pair<int, int>, StoredPage >::iterator it = stored.lower_bound( make_pair(pid, INT_MIN) );
+		while( it != stored.end() && it->first.first == pid ){ erase( it++ ); }
+	}
+
+	//Returns the dirty spills since the last call. Someone has to wait for those writes
+	int takePendingWrites(){
+		int writes = pendingWrites;
+		pendingWrites = 0;
+		return writes;
+	}
+
+	//Display pool totals. Effective memory counts the pool's pages at their full size
+	void displayStats( int frameCount ){
+		cout << "Compressed pool: " << stores << " stores; " << loads << " loads; " << spills << " spills (" << dirtySpills << " dirty); "
+			 << rejected << " rejected" << endl;
+		cout << "Peak pool: " << peakPages << " pages in " << peakBytes << "/" << capacity << " bytes; Effective memory: " 
+			 << (frameCount + peakPages) * pageSize << " bytes (" << frameCount * pageSize << " in frames)" << endl;
+	}
+};
+
+
+//Multi-node physical memory. The frames are split into 'nodeCount' contiguous pools, one per node,
+//each swept by its own clock hand. A process starts out running on node pid % nodeCount, and
+//with rebalancing on the scheduler moves it to the next node every 'rebalanceInterval' dispatches.
+//	Placement policies
+//		First touch	(A page goes to the node the faulting process is running on)
+//		Interleave	(Pages are spread over the nodes by page number)
+//Every access costs distances[running node][frame's node]. With migration on, a page accessed from
+//the same remote node 'migrateThreshold' times in a row is moved over to that node.
+class NumaTopology{
+private:
+	int nodeCount, framesPerNode, frameCount;
+	bool interleave;
+	vector< vector<int> > distances;
+	int rebalanceInterval, migrateThreshold, migratePenalty;	//0 turns rebalancing/migration off
+	map< int, pair<int, int> > runNodes;						//pid -> (node it's running on, dispatches)
+	vector<int> streakNodes, streaks;							//Per frame: the remote node accessing it in a row, and how many times
+	vector<uint64_t> placements, localAccesses, remoteAccesses;	//Per node
+	uint64_t accessCost, remoteOverhead, migrations, migrationWrites;
+
+public:
+	NumaTopology( int nodeCount, int frameCount, bool interleave, vector<int>& distanceList, int rebalanceInterval, int migrateThreshold, int migratePenalty )
+		: nodeCount(nodeCount), framesPerNode(frameCount / nodeCount), frameCount(frameCount), interleave(interleave),
+		  distances( nodeCount, vector<int>( nodeCount, 20 ) ), rebalanceInterval(rebalanceInterval), migrateThreshold(migrateThreshold), migratePenalty(migratePenalty),
+		  streakNodes( frameCount, -1 ), streaks( frameCount, 0 ), placements( nodeCount, 0 ), localAccesses( nodeCount, 0 ), remoteAccesses( nodeCount, 0 ),
+		  accessCost(0), remoteOverhead(0), migrations(0), migrationWrites(0) {
+
+		//Row-major distances if all of them were given, otherwise local 10 and remote 20
+		for( int from = 0; from < nodeCount; ++from ){
+			for( int to = 0; to < nodeCount; ++to ){
+				if( int(distanceList.size()) == nodeCount*nodeCount ){ distances[from][to] = distanceList[from*nodeCount + to]; }
+				else if( from == to ){ distances[from][to] = 10; }
+			}
+		}
+	}
+
+	int getNodeCount(){ return nodeCount; }
+
+	//First frame of a node's pool, and one past its last. The last node takes the leftover frames
+	int firstFrame( int node ){ return node * framesPerNode; }
+	int endFrame( int node ){ return (node == nodeCount - 1) ? frameCount : (node + 1) * framesPerNode; }
+	int nodeOf( int frame ){ return min( frame / framesPerNode, nodeCount - 1 ); }
+
+	//Node the process is currently running on
+	int getRunNode( int pid ){
+		map< int, pair<int, int> >::iterator found = runNodes.find( pid );
+		return (found == runNodes.end()) ? pid % nodeCount : found->second.first;
+	}
+
+	//Counts a dispatch, moving the process to the next node when it's time to rebalance
+	void onDispatch( int pid ){
+		map< int, pair<int, int> >::iterator found = runNodes.find( pid );
+		if( found == runNodes.end() ){ found = runNodes.insert( make_pair( pid, make_pair( pid % nodeCount, 0 ) ) ).first; }
+		if( rebalanceInterval > 0 && ++found->second.second % rebalanceInterval == 0 ){
+			found->second.first = (found->second.first + 1) % nodeCount;
+		}
+	}
+
+	//Node a faulting page should be placed on
+	int targetNode( PageTableEntry& request ){
+		return interleave ? request.page % nodeCount : getRunNode( request.pid );
+	}
+
+	//A frame got a new page, so any run of remote accesses to the old one is over
+	void placed( int frame ){
+		placements[nodeOf(frame)]++;
+		streakNodes[frame] = -1;
+		streaks[frame] = 0;
+	}
+
+	//Charges an access to a frame. Returns true if the page should migrate to the accessing process' node
+	bool recordAccess( int pid, int frame ){
+		int from = getRunNode( pid ), to = nodeOf( frame );
+		accessCost += distances[from][to];
+		if( from == to ){
+			localAccesses[from]++;
+			streaks[frame] = 0;
+			return false;
+		}
+
+		remoteAccesses[from]++;
+		remoteOverhead += distances[from][to] - distances[from][from];
+		if( streakNodes[frame] == from ){ streaks[frame]++; }
+		else{ streakNodes[frame] = from; streaks[frame] = 1; }
+		return migrateThreshold > 0 && streaks[frame] >= migrateThreshold;
+	}
+
+	//Counts a page moved between nodes. Copying it costs the same as overhead
+	void recordMigration(){
+		migrations++;
+		remoteOverhead += migratePenalty;
+	}
+
+	//Counts a dirty frame a migration evicted. Writing it out is overhead too
+	void recordMigrationWrite( int writePenalty ){
+		migrationWrites++;
+		remoteOverhead += writePenalty;
+	}
+
+	//Display placement and access totals per node
+	void displayStats(){
+		uint64_t local = 0, remote = 0;
+		for( int node = 0; node < nodeCount; ++node ){
+			cout << "Node " << node << ": " << endFrame(node) - firstFrame(node) << " frames; " << placements[node] << " placements; "
+				 << localAccesses[node] << " local accesses; " << remoteAccesses[node] << " remote accesses" << endl;
+			local += localAccesses[node];
+			remote += remoteAccesses[node];
+		}
+		cout << "Remote accesses: " << remote << "/" << local + remote << " (" << (local + remote > 0 ? 100.0 * remote / (local + remote) : 0.0) << "%); "
+			 << "Access cost: " << accessCost << "; Remote overhead: " << remoteOverhead << "; Migrations: " << migrations << " (" << migrationWrites << " dirty evictions)" << endl;
+	}
+};
+
+
+//Groups of frames a huge page search looks at before giving up
+const int HUGE_SCAN_GROUPS = 8;
+
+
 class Clock{
 private:
 	PageTable* frames;
 	int next;
 	bool debug;
+	FrameBits validBits, refBits, dirtyBits;	//Per-frame state, kept out of the entries so sweeps don't chase pointers
+	int dirtyCount;
+
+	//Shared pages. A shared frame holds one copy of the page for every process that has read it
+	FrameBits sharedBits;
+	map<int, int> sharedFrames;				//Shared page -> frame holding it
+	map< int, set<int> > frameSharers;		//Shared frame -> pids mapping it
+	int framesSaved, peakFramesSaved;
+	uint64_t sharedMappings, cowCopies, cowReuses;
+
+	//Huge pages. A huge frame is 'hugeRatio' contiguous base frames, aligned to hugeRatio, mapped as one
+	int hugeRatio;
+	vector<int> hugeBase;					//First frame of the huge mapping each frame belongs to, or -1
+	int validCount, hugeCount, peakHugeCount, peakTlbEntries, peakBaseEntries;
+	uint64_t promotions, demotions;
+
+	CompressedPool* pool;					//NULL when there's no compressed tier
+
+	NumaTopology* numa;						//NULL when memory is a single node
+	vector<int> nodeHands;					//Clock hand of each node's pool
 
 public:
-	Clock( PageTable* frames, bool debug ) : frames(frames), next(int(0)), debug(debug) {}
+	Clock( PageTable* frames, bool debug ) 
+		: frames(frames), next(int(0)), debug(debug), validBits(frames->maxPages), refBits(frames->maxPages), dirtyBits(frames->maxPages), dirtyCount(0),
+		  sharedBits(frames->maxPages), framesSaved(0), peakFramesSaved(0), sharedMappings(0), cowCopies(0), cowReuses(0),
+		  hugeRatio(0), validCount(0), hugeCount(0), peakHugeCount(0), peakTlbEntries(0), peakBaseEntries(0), promotions(0), demotions(0), pool(NULL), numa(NULL) {}
+
+
+	//Splits the frames into the topology's nodes, each with its own hand
+	void setTopology( NumaTopology* topology ){
+		numa = topology;
+		nodeHands.clear();
+		for( int node = 0; node < numa->getNodeCount(); ++node ){ nodeHands.push_back( numa->firstFrame(node) ); }
+	}
+
+
+	//Evicted pages go through the compressed pool from now on
+	void setCompressedPool( CompressedPool* compressedPool ){ pool = compressedPool; }
+
+	//A page placed into a frame some other way than a fault's pool->load takes its compressed copy
+	//back, so the pool never holds a page twice and a dirty copy keeps its dirty bit
+	void reloadFromPool( PageTableEntry& entry ){
+		bool dirty = false;
+		if( pool != NULL && pool->load( entry.pid, entry.page, dirty ) && dirty ){ setDirty( entry.frame ); }
+	}
+
+	//Offers a private frame's page to the compressed pool before it's evicted. Returns true if the pool took it
+	bool evictToPool( int index ){
+		if( pool == NULL || !validBits.test(index) || sharedBits.test(index) ){ return false; }
+		return pool->store( frames->pages[index]->pid, frames->pages[index]->page, dirtyBits.test(index) );
+	}
+
+
+	//Turns on huge frames made of 'ratio' base frames
+	void enableHugePages( int ratio ){
+		hugeRatio = ratio;
+		hugeBase.assign( frames->maxPages, -1 );
+	}
+
+	//Returns the number of base frames in a huge frame, or 0 if huge pages are off
+	int getHugeRatio(){ return hugeRatio; }
+
+	//Splits a huge mapping back into base frames. The pages stay where they are
+	void demote( int base, bool underPressure ){
+		for( int i = 0; i < hugeRatio; ++i ){ hugeBase[base + i] = -1; }
+		hugeCount--;
+		if( underPressure ){ demotions++; }
+	}
+
+	//Empties a single frame
+	void freeFrame( int index ){
+		if( hugeRatio > 0 && hugeBase[index] >= 0 ){ demote( hugeBase[index], false ); }
+		frames->pages[index] = NULL;
+		validBits.clear( index );
+		refBits.clear( index );
+		cleanFrame( index );
+		validCount--;
+	}
+
+	//Tracks how many translations the resident pages need, with and without huge mappings
+	void recordTlbReach(){
+		peakHugeCount = max( peakHugeCount, hugeCount );
+		peakTlbEntries = max( peakTlbEntries, validCount - hugeCount*(hugeRatio - 1) );
+		peakBaseEntries = max( peakBaseEntries, validCount );
+	}
+
+
+	//Finds an aligned group of frames that are all free or unreferenced, clock style, among the
+	//HUGE_SCAN_GROUPS groups starting at the hand's group. The first pass looks for one as is, then
+	//the window's frames lose their second chance and the second pass looks again. The hand moves
+	//past the window either way, so the next search sweeps different groups.
+	//Groups holding shared frames or another huge mapping are skipped. Returns -1 if there isn't one
+	int findHugeGroup(){
+		int groups = frames->maxPages / hugeRatio;
+		if( groups == 0 ){ return -1; }
+		int startGroup = (next / hugeRatio) % groups;
+		int window = min( groups, HUGE_SCAN_GROUPS );
+		for( int pass = 0; pass < 2; ++pass ){
+			for( int g = 0; g < window; ++g ){
+				int base = ((startGroup + g) % groups) * hugeRatio;
+				bool usable = true;
+				for( int i = base; i < base + hugeRatio && usable; ++i ){
+					usable = !sharedBits.test(i) && hugeBase[i] < 0 && !( validBits.test(i) && refBits.test(i) );
+				}
+				if( usable ){ return base; }
+			}
+			for( int g = 0; g < window && pass == 0; ++g ){
+				int base = ((startGroup + g) % groups) * hugeRatio;
+				for( int i = base; i < base + hugeRatio; ++i ){
+					if( hugeBase[i] < 0 ){ refBits.clear( i ); }
+				}
+			}
+		}
+		next = ((startGroup + window) % groups) * hugeRatio;
+		return -1;
+	}
+
+
+	//Maps a whole region into one huge frame. Region pages that were already resident move in without
+	//a write, anything else in the group is evicted. Returns the first frame, or -1 if no group is usable.
+	//pagesRead counts the region pages that weren't resident and had to be read in
+	int promoteRegion( vector<PageTableEntry*>& entries, int& dirtyEvictions, int& pagesRead ){
+		int base = findHugeGroup();
+		if( base < 0 ){ return -1; }
+
+		vector<bool> wasDirty( hugeRatio, false );
+		pagesRead = hugeRatio;
+		for( int i = 0; i < hugeRatio; ++i ){
+			PageTableEntry* current = entries[i];
+			if( !current->validBit || !validBits.test(current->frame) ){ continue; }
+			PageTableEntry* resident = frames->pages[current->frame];
+			if( resident->pid == current->pid && resident->page == current->page && !sharedBits.test(current->frame) ){
+				wasDirty[i] = dirtyBits.test( current->frame );
+				freeFrame( current->frame );
+				pagesRead--;
+			}
+		}
+
+		dirtyEvictions = 0;
+		for( int i = base; i < base + hugeRatio; ++i ){
+			if( !validBits.test(i) ){ continue; }
+			if( !evictToPool(i) && dirtyBits.test(i) ){ dirtyEvictions++; }
+			freeFrame( i );
+		}
+
+		for( int i = 0; i < hugeRatio; ++i ){
+			int index = base + i;
+			frames->pages[index] = entries[i];
+			validBits.set( index );
+			refBits.set( index );
+			if( wasDirty[i] ){ setDirty( index ); }
+			hugeBase[index] = base;
+			entries[i]->frame = index;
+			entries[i]->validBit = true;
+			reloadFromPool( *entries[i] );
+			validCount++;
+		}
+		hugeCount++;
+		promotions++;
+		next = (base + hugeRatio) % frames->maxPages;
+		recordTlbReach();
+		return base;
+	}
 
 
 	//Searches through the vector of pages to see if the process reference exists. True is returned if a fault occurs
 	bool checkPageFault( PageTableEntry* request ){
 		int checkIndex = request->frame;
-		if( frames->pages[checkIndex] != NULL &&
-			frames->pages[checkIndex]->pid == request->pid ){
+		if( request->shared ){ return checkSharedFault( request ); }
+		if( validBits.test(checkIndex) && !sharedBits.test(checkIndex) &&
+			frames->pages[checkIndex]->pid == request->pid && frames->pages[checkIndex]->page == request->page ){
 				return false;
 		}
 		return true;
 	}
 
 
+	//A shared reference hits if the process still maps the frame holding the page. Writes always fault so the page can be copied
+	bool checkSharedFault( PageTableEntry* request ){
+		map<int, int>::iterator found = sharedFrames.find( request->page );
+		if( found == sharedFrames.end() || found->second != request->frame || request->dirtyBit ){ return true; }
+		return frameSharers[found->second].count( request->pid ) == 0;
+	}
+
+
+	//Drops a process from a shared frame's sharers. Returns true if nobody maps the frame anymore
+	bool removeSharer( int index, int pid ){
+		set<int>& sharers = frameSharers[index];
+		if( sharers.erase( pid ) == 0 ){ return sharers.empty(); }
+		if( sharers.size() > 0 ){ framesSaved--; }
+		return sharers.empty();
+	}
+
+
+	//Forgets that a frame holds a shared page
+	void releaseShared( int index ){
+		int sharers = int( frameSharers[index].size() );
+		if( sharers > 1 ){ framesSaved -= sharers - 1; }
+		sharedFrames.erase( frames->pages[index]->page );
+		frameSharers.erase( index );
+		sharedBits.clear( index );
+	}
+
+
+	//Handles a fault on a shared page.
+	//	Returns the type of placement
+	//		Shared			(The page was already in memory, so the process maps the same frame)
+	//		CoW Reuse		(A write by the last process mapping the page, which takes the frame over)
+	//		CoW <type>		(A write that copied the page into a new frame placed as findOpenMemory would)
+	//		<type>			(The page wasn't in memory and was read into a new frame)
+	string findSharedMemory( PageTableEntry& request ){
+		map<int, int>::iterator found = sharedFrames.find( request.page );
+		bool resident = found != sharedFrames.end();
+		int index = resident ? found->second : -1;
+
+		//Reads map the existing copy, or bring in the copy everyone else will share
+		if( !request.dirtyBit ){
+			if( resident ){
+				if( frameSharers[index].insert( request.pid ).second ){ framesSaved++; }
+				peakFramesSaved = max( peakFramesSaved, framesSaved );
+				sharedMappings++;
+				refBits.set( index );
+				request.frame = index;
+				request.validBit = true;
+				return "Shared";
+			}
+			string placementType = findOpenMemory( request );
+			sharedFrames[request.page] = request.frame;
+			frameSharers[request.frame].insert( request.pid );
+			sharedBits.set( request.frame );
+			return placementType;
+		}
+
+		//Writes get a private copy. If this process is the only one left mapping the page, it just takes the frame
+		request.shared = false;
+		if( resident && frameSharers[index].count( request.pid ) > 0 ){
+			if( frameSharers[index].size() == 1 ){
+				releaseShared( index );
+				frames->pages[index] = &request;
+				setReferenced( index );
+				setDirty( index );
+				request.frame = index;
+				request.validBit = true;
+				cowReuses++;
+				return "CoW Reuse";
+			}
+			removeSharer( index, request.pid );
+		}
+		string placementType = findOpenMemory( request );
+		if( !resident ){ return placementType; }
+		cowCopies++;
+		return "CoW " + placementType;
+	}
+
+
+	//Scans the bitmaps a word at a time for the first frame in [from, end) that is free or unreferenced.
+	//Returns -1 if there isn't one
+	int findVictimFrom( int from, int end ){
+		if( from >= end ){ return -1; }
+		size_t wordIndex = from / 64;
+		uint64_t candidates = ~(validBits.words[wordIndex] & refBits.words[wordIndex]) & (~uint64_t(0) << (from % 64));
+		while( true ){
+			candidates &= validBits.wordMask( wordIndex );
+			if( candidates != 0 ){
+				int victim = int( wordIndex*64 + lowestSetBit(candidates) );
+				return (victim < end) ? victim : -1;
+			}
+			if( ++wordIndex >= validBits.words.size() || wordIndex*64 >= size_t(end) ){ return -1; }
+			candidates = ~(validBits.words[wordIndex] & refBits.words[wordIndex]);
+		}
+	}
+
+
 	//Searches through the vector of pages to find a space for the reference.
+	//With more than one node, only the pool of the node the topology picks is searched
 	//	Returns the type of placement
-	//		Free	(Returned if a NULL is replaced)
-	//		Clean	(Returned if a clean entry was replaced)
-	//		Dirty	(Returned if a dirty entry was replaced)
+	//		Free		(Returned if a NULL is replaced)
+	//		Clean		(Returned if a clean entry was replaced)
+	//		Dirty		(Returned if a dirty entry was replaced)
+	//		Compressed	(Returned if the replaced entry went into the compressed pool)
 	string findOpenMemory( PageTableEntry& request ){
-		string placementType;
-		bool found = false;
-		
-		while( !found ){
-			if( frames->pages[next] == NULL || frames->pages[next]->refBit == 0 ){
+		return findOpenMemoryOn( request, (numa != NULL) ? numa->targetNode( request ) : 0 );
+	}
 
-				if( frames->pages[next] == NULL )	{ placementType = "Free"; }
-				else if( frames->pages[next]->dirtyBit )	{ placementType = "Dirty"; }
-				else { placementType = "Clean"; }
 
-				frames->pages[next] = &request;
-				request.frame = next;
-				found = true;
-			}
-			else if( frames->pages[next]->refBit == 1 ){
-				frames->pages[next]->refBit = 0; 
+	//Runs the clock over one node's pool to find a space for the reference. Returns the type of placement as findOpenMemory does
+	string findOpenMemoryOn( PageTableEntry& request, int node ){
+		string placementType;
+		int first = 0, last = frames->maxPages;
+		if( numa != NULL ){
+			first = numa->firstFrame( node );
+			last = numa->endFrame( node );
+			next = nodeHands[node];
+		}
+
+		//Every referenced frame the hand passes gets its second chance taken away in bulk.
+		//If the hand makes it all the way around, every ref bit is clear and it lands where it started
+		int victim = findVictimFrom( next, last );
+		if( victim < 0 ){
+			refBits.clearRange( next, last );
+			victim = findVictimFrom( first, last );
+			if( victim < 0 ){
+				refBits.clearRange( first, next );
+				victim = next;
 			}
-			
-			//Circular increment
-			next = (next+1) % frames->maxPages;
+			else{ refBits.clearRange( first, victim ); }
+		}
+		else{ refBits.clearRange( next, victim ); }
+
+		if( !validBits.test(victim) )	{ placementType = "Free"; }
+		else if( evictToPool(victim) )	{ placementType = "Compressed"; }
+		else if( dirtyBits.test(victim) )	{ placementType = "Dirty"; }
+		else { placementType = "Clean"; }
+		if( sharedBits.test(victim) ){ releaseShared( victim ); }
+		if( hugeRatio > 0 && hugeBase[victim] >= 0 ){ demote( hugeBase[victim], true ); }	//Memory pressure broke the huge mapping up
+		if( !validBits.test(victim) ){ validCount++; }
+
+		frames->pages[victim] = &request;
+		request.frame = victim;
+		validBits.set( victim );
+		refBits.assign( victim, request.refBit );
+		dirtyCount += int(request.dirtyBit) - int(dirtyBits.test(victim));
+		dirtyBits.assign( victim, request.dirtyBit );
+
+		//Circular increment
+		next = (victim+1 == last) ? first : victim+1;
+		if( numa != NULL ){
+			nodeHands[node] = next;
+			numa->placed( victim );
 		}
 
 		//Tell the request that they've got a spot in memory! Woohoo!
 		request.validBit = true;
+		recordTlbReach();
 		return placementType;
 	}
 
 
+	//Moves the entry's private page into a frame on another node, evicting whatever that node's clock picks.
+	//Returns the new frame, or -1 if the page can't move (shared and huge mapped pages stay put)
+	int migrate( PageTableEntry& entry, int node, string& placementType ){
+		int index = entry.frame;
+		if( sharedBits.test(index) || (hugeRatio > 0 && hugeBase[index] >= 0) ){ return -1; }
+		bool wasDirty = dirtyBits.test( index );
+		freeFrame( index );
+
+		entry.refBit = 1;
+		placementType = findOpenMemoryOn( entry, node );
+		if( wasDirty ){ setDirty( entry.frame ); }
+		numa->recordMigration();
+		return entry.frame;
+	}
+
+
 	//Returns the frame page table entry at the requested index
 	PageTableEntry* getFrameEntryAt( int index ){
 		return frames->pages[index];
 	}
 
-	//Cleans out pages with the given process id
-	void clearPID( int pid ){
+	//Marks the frame as recently used
+	void setReferenced( int index ){ refBits.set( index ); }
+
+	//Marks the frame as written to
+	void setDirty( int index ){ 
+		if( !dirtyBits.test(index) ){ dirtyBits.set( index ); dirtyCount++; }
+	}
+
+	//Marks the frame as written back to the backing store
+	void cleanFrame( int index ){
+		if( dirtyBits.test(index) ){ dirtyBits.clear( index ); dirtyCount--; }
+	}
+
+	//Collects up to 'limit' dirty frames in the order the hand will reach them
+	void findDirtyAhead( int limit, vector<int>& found ){
+		int index = dirtyBits.findNext( next );
+		while( index >= 0 && int(found.size()) < limit ){
+			found.push_back( index );
+			index = dirtyBits.findNext( index + 1 );
+		}
+		index = dirtyBits.findNext( 0 );
+		while( index >= 0 && index < next && int(found.size()) < limit ){
+			found.push_back( index );
+			index = dirtyBits.findNext( index + 1 );
+		}
+	}
+
+	//Returns the number of dirty frames
+	int getDirtyCount(){ return dirtyCount; }
+
+	//Returns the number of frames
+	int getFrameCount(){ return frames->maxPages; }
+
+	//Display huge page totals
+	void displayHugePageStats(){
+		cout << "Huge pages: " << promotions << " promotions; " << demotions << " demotions; Peak huge mappings: " << peakHugeCount
+			 << "; Peak TLB entries: " << peakTlbEntries << " (" << peakBaseEntries << " with base pages only)" << endl;
+	}
+
+	//Display sharing totals
+	void displaySharingStats(){
+		cout << "Sharing: " << sharedMappings << " shared mappings; Peak frames saved: " << peakFramesSaved 
+			 << "; CoW copies: " << cowCopies << "; CoW reuses: " << cowReuses << endl;
+	}
+
+	//Cleans out pages with the given process id. Returns how many of the freed frames were dirty
+	int clearPID( int pid ){
+		int dirtyFrames = 0;
 		if( debug ){ cout << "Freeing frames: "; }
 		for( size_t i = 0; i < frames->pages.size(); ++i ){
-			if( frames->pages[i] != NULL && frames->pages[i]->pid == pid ){
-				frames->pages[i] = NULL;
-				if( debug ){ cout << i << " "; }
+			if( !validBits.test(i) ){ continue; }
+
+			//A shared frame is only freed once the last process mapping it is gone
+			if( sharedBits.test(i) ){
+				if( frameSharers[int(i)].count( pid ) == 0 || !removeSharer( int(i), pid ) ){ continue; }
+				releaseShared( int(i) );
 			}
+			else if( frames->pages[i]->pid != pid ){ continue; }
+
+			if( dirtyBits.test(i) ){ dirtyFrames++; }
+			freeFrame( int(i) );
+			if( debug ){ cout << i << " "; }
 		}
 		if( debug ){ cout << endl; }
+		return dirtyFrames;
 	}
 
 
@@ -199,20 +1176,20 @@ public:
 			if( i == next ){ cout << "->" << i << ") "; }
 			else{ cout << "  " << i << ") ";}
 
-			if( frames->pages[i] == NULL ){
+			if( !validBits.test(i) ){
 				cout << "EMPTY" << endl;
 			}
 			else{
 				PageTableEntry* current = frames->pages[i];
-				cout << "R/W: " << ((current->dirtyBit) ? 'W' : 'R' ) << "; VA: " << current->addr
-					<< "; PID: " << current->pid << "; Ref: " << current->refBit << endl;
+				cout << "R/W: " << (dirtyBits.test(i) ? 'W' : 'R' ) << "; VA: " << current->addr
+					<< "; PID: " << current->pid << "; Ref: " << refBits.test(i) << endl;
 			}
 		}
 
 		
 		cout << "  Free Frames: ";
 		for( size_t i = 0; i < frames->pages.size(); ++i ){
-			if( frames->pages[i] == NULL ){ cout << i << " "; }
+			if( !validBits.test(i) ){ cout << i << " "; }
 		}
 		cout << endl;
 	}
@@ -220,22 +1197,371 @@ public:
 };
 
 
+//Clock that many worker threads can run against one frame pool at the same time.
+//The hand is a shared atomic counter, reference/dirty bits are updated with atomic ORs,
+//and a thread must claim a frame with a CAS before it may inspect or replace it.
+class ConcurrentClock{
+private:
+	int maxFrames;
+	atomic<uint64_t> hand;
+	atomic<PageTableEntry*>* slots;
+	atomic<int>* claims;
+	atomic<uint64_t>* refWords;
+	atomic<uint64_t>* dirtyWords;
+	atomic<uint64_t> handAdvances, claimCollisions;
+
+	static uint64_t frameBit( int index ){ return uint64_t(1) << (index%64); }
+
+public:
+	ConcurrentClock( int maxFrames ) : maxFrames(maxFrames), hand(0), handAdvances(0), claimCollisions(0) {
+		int numWords = (maxFrames + 63) / 64;
+		slots = new atomic<PageTableEntry*>[maxFrames];
+		claims = new atomic<int>[maxFrames];
+		refWords = new atomic<uint64_t>[numWords];
+		dirtyWords = new atomic<uint64_t>[numWords];
+		for( int i = 0; i < maxFrames; ++i ){ slots[i] = NULL; claims[i] = 0; }
+		for( int i = 0; i < numWords; ++i ){ refWords[i] = 0; dirtyWords[i] = 0; }
+	}
+
+	~ConcurrentClock(){
+		delete[] slots;
+		delete[] claims;
+		delete[] refWords;
+		delete[] dirtyWords;
+	}
+
+
+	//True is returned if the reference's frame no longer belongs to its process
+	bool checkPageFault( PageTableEntry* request ){
+		PageTableEntry* current = slots[request->frame].load();
+		return current == NULL || current->pid != request->pid || current->page != request->page;
+	}
+
+
+	//Same placement types as Clock::findOpenMemory, but safe to call from several threads at once
+	string findOpenMemory( PageTableEntry& request ){
+		while( true ){
+			int index = int( hand.fetch_add(1) % maxFrames );
+			handAdvances.fetch_add( 1, memory_order_relaxed );
+
+			//Someone else is working on this frame, so move along
+			int unclaimed = 0;
+			if( !claims[index].compare_exchange_strong( unclaimed, 1 ) ){
+				claimCollisions.fetch_add( 1, memory_order_relaxed );
+				continue;
+			}
+
+			uint64_t bit = frameBit( index );
+			PageTableEntry* current = slots[index].load();
+			if( current != NULL && ( refWords[index/64].fetch_and( ~bit ) & bit ) ){
+				claims[index].store( 0 );
+				continue;
+			}
+
+			string placementType;
+			if( current == NULL )	{ placementType = "Free"; }
+			else if( dirtyWords[index/64].load() & bit )	{ placementType = "Dirty"; }
+			else { placementType = "Clean"; }
+
+			if( request.dirtyBit ){ dirtyWords[index/64].fetch_or( bit ); }
+			else{ dirtyWords[index/64].fetch_and( ~bit ); }
+			if( request.refBit ){ refWords[index/64].fetch_or( bit ); }
+
+			request.frame = index;
+			request.validBit = true;
+			slots[index].store( &request );
+			claims[index].store( 0 );
+			return placementType;
+		}
+	}
+
+
+	//Marks the frame as recently used
+	void setReferenced( int index ){ refWords[index/64].fetch_or( frameBit(index), memory_order_relaxed ); }
+
+	//Marks the frame as written to
+	void setDirty( int index ){ dirtyWords[index/64].fetch_or( frameBit(index), memory_order_relaxed ); }
+
+	//Cleans out pages with the given process id
+	void clearPID( int pid ){
+		for( int i = 0; i < maxFrames; ++i ){
+			PageTableEntry* current = slots[i].load();
+			if( current == NULL || current->pid != pid ){ continue; }
+
+			int unclaimed = 0;
+			while( !claims[i].compare_exchange_weak( unclaimed, 1 ) ){ unclaimed = 0; this_thread::yield(); }
+			if( slots[i].load() == current ){
+				slots[i].store( NULL );
+				refWords[i/64].fetch_and( ~frameBit(i) );
+				dirtyWords[i/64].fetch_and( ~frameBit(i) );
+			}
+			claims[i].store( 0 );
+		}
+	}
+
+	//Number of frames the hand has stepped over
+	uint64_t getHandAdvances(){ return handAdvances.load(); }
+
+	//Number of times the hand landed on a frame another thread had claimed
+	uint64_t getClaimCollisions(){ return claimCollisions.load(); }
+};
+
+
+//Simulated background cleaner. Once the share of dirty frames reaches the high watermark it
+//writes back dirty frames ahead of the clock hand until the share drops to the low watermark.
+//Adjacent pages of the same process go out as one batch of at most 'maxBatch' pages, and
+//'bandwidth' is the number of batches it can write per tick. So it never writes more than
+//bandwidth*maxBatch pages a tick, and clustered dirty pages drain faster than scattered ones.
+class WritebackDaemon{
+private:
+	int bandwidth, maxBatch, highWatermark, lowWatermark;	//Watermarks are percentages of the frame table
+	bool active;
+	uint64_t pagesWritten, batches, activeTicks;
+	map<int, uint64_t> pagesWrittenByPID;
+
+public:
+	WritebackDaemon( int bandwidth, int maxBatch, int highWatermark, int lowWatermark )
+		: bandwidth(bandwidth), maxBatch(max( maxBatch, 1 )), highWatermark(highWatermark), lowWatermark(lowWatermark), active(false), pagesWritten(0), batches(0), activeTicks(0) {}
+
+	//Runs one clock tick of the cleaner
+	void tick( Clock* MMU, bool debug ){
+		int dirtyPercent = MMU->getDirtyCount() * 100 / MMU->getFrameCount();
+		if( !active && dirtyPercent >= highWatermark ){ active = true; }
+		else if( active && dirtyPercent <= lowWatermark ){ active = false; }
+		if( !active || bandwidth <= 0 ){ return; }
+		activeTicks++;
+
+		//Don't write more than it takes to reach the low watermark
+		int target = MMU->getFrameCount() * lowWatermark / 100;
+		vector<int> found;
+		MMU->findDirtyAhead( MMU->getDirtyCount() - target, found );
+		if( found.empty() ){ return; }
+
+		//Group the frames into runs of consecutive pages of one process. Each run remembers how close
+		//to the hand its nearest frame is, so the runs the clock reaches first get written first
+		vector< pair< pair<int, int>, int > > pages;	//((pid, page), position ahead of the hand)
+		for( size_t i = 0; i < found.size(); ++i ){
+			PageTableEntry* current = MMU->getFrameEntryAt( found[i] );
+			pages.push_back( make_pair( make_pair( current->pid, current->page ), int(i) ) );
+		}
+		sort( pages.begin(), pages.end() );
+		vector< pair<int, size_t> > runs;				//(nearest position, first index in pages)
+		for( size_t i = 0; i < pages.size(); ++i ){
+			if( i == 0 || pages[i].first.first != pages[i-1].first.first || pages[i].first.second > pages[i-1].first.second + 1 ){
+				runs.push_back( make_pair( pages[i].second, i ) );
+			}
+			else{ runs.back().first = min( runs.back().first, pages[i].second ); }
+		}
+		sort( runs.begin(), runs.end() );
+
+		if( debug ){ cout << "Writeback: "; }
+		for( size_t r = 0; r < runs.size() && r < size_t(bandwidth); ++r ){
+			size_t i = runs[r].second;
+			int batchPages = 0;
+			do{
+				int index = found[pages[i].second];
+				MMU->cleanFrame( index );
+				pagesWritten++;
+				pagesWrittenByPID[pages[i].first.first]++;
+				if( debug ){ cout << index << " "; }
+				i++;
+			} while( ++batchPages < maxBatch && i < pages.size() && pages[i].first.first == pages[i-1].first.first && pages[i].first.second == pages[i-1].first.second + 1 );
+			batches++;
+		}
+		if( debug ){ cout << endl; }
+	}
+
+	//Pages written back for the given process
+	uint64_t getPagesWritten( int pid ){
+		map<int, uint64_t>::iterator found = pagesWrittenByPID.find( pid );
+		return (found == pagesWrittenByPID.end()) ? 0 : found->second;
+	}
+
+	//Display cleaner totals
+	void displayStats(){
+		cout << "Writeback: " << pagesWritten << " pages in " << batches << " batches over " << activeTicks << " active ticks" << endl;
+	}
+};
+
+
+//Adaptive read-ahead. Each process' faults are watched for a constant page stride. Once the
+//same stride shows up twice the next 'window' pages along it are brought in during the same
+//blocked interval. The window doubles every time the stream continues (up to maxWindow)
+//and halves when it breaks.
+class Prefetcher{
+private:
+	int maxWindow;
+	uint64_t prefetches, useful, wasted;
+
+public:
+	Prefetcher( int maxWindow ) : maxWindow(maxWindow), prefetches(0), useful(0), wasted(0) {}
+
+	//Called on every hit. Counts the first use of a prefetched page
+	void onHit( Process* current, PageTableEntry* currentEntry ){
+		if( current->takePrefetched( currentEntry->page ) ){ useful++; }
+	}
+
+	//Called when a process finishes. Whatever it never used was wasted
+	void onExit( Process* current ){ wasted += current->pendingPrefetches(); }
+
+	//Called after the faulting page has been placed. Returns the extra wait for any dirty frames it had to evict
+	int onFault( Process* current, PageTableEntry* currentEntry, Clock* MMU, int dirtyPagePenalty, bool debug ){
+		int page = currentEntry->page;
+
+		//A prefetched page that faults was evicted before it was ever used
+		if( current->takePrefetched( page ) ){ wasted++; }
+
+		//Only a stride that repeats is worth reading ahead on. A broken stream shrinks the window
+		int lastPage = current->getLastFaultPage();
+		int delta = page - lastPage;
+		int stride = current->getStride();
+		int window = current->getWindow();
+		if( lastPage < 0 || delta == 0 || delta != stride ){
+			current->setReadAhead( page, (lastPage < 0) ? 0 : delta, window/2 );
+			return 0;
+		}
+		window = (window == 0) ? 1 : min( window*2, maxWindow );
+
+		//Leave the faulting page its frame, or the read-ahead would start evicting itself
+		window = min( window, MMU->getFrameCount() - 1 );
+
+		//Read ahead along the stride. The next fault of an unbroken stream lands one stride past the last page read
+		int extraWait = 0;
+		int target = page;
+		for( int i = 0; i < window; ++i ){
+			if( target + stride < 0 || target + stride >= current->getPageCount() ){ break; }
+			target += stride;
+
+			PageTableEntry* targetEntry = current->getPageEntry( target );
+			if( targetEntry->shared || (targetEntry->validBit && !MMU->checkPageFault( targetEntry )) ){ continue; }
+
+			targetEntry->refBit = 0;	//Unused read-ahead should be the first thing the clock takes back
+			string placementType = MMU->findOpenMemory( *targetEntry );
+
+			//The page is read, not written, so it comes in clean unless its compressed copy was dirty
+			MMU->cleanFrame( targetEntry->frame );
+			MMU->reloadFromPool( *targetEntry );
+			current->mapPage( target, targetEntry->frame );
+			if( current->takePrefetched( target ) ){ wasted++; }	//Read ahead before, but evicted without being used
+			current->markPrefetched( target );
+			prefetches++;
+			if( placementType == "Dirty" ){ extraWait += dirtyPagePenalty; }
+
+			if( debug ){ cout << "Prefetch: Page: " << target << "; " << placementType << "; Frame: " << targetEntry->frame << endl; }
+		}
+		current->setReadAhead( target, stride, window );
+		return extraWait;
+	}
+
+	//Display read-ahead totals
+	void displayStats(){
+		cout << "Prefetch: " << prefetches << " pages; Useful: " << useful << "; Wasted: " << wasted << endl;
+	}
+};
+
+
+//Working set / page fault frequency load control.
+//Each admitted process' demand is the number of distinct pages in its last 'window' references.
+//A process that faults again within 'pffInterval' references while the total demand is larger
+//than the frame pool is swapped out, and swapped out processes are only let back in once their
+//working set fits in what's left.
+class LoadController{
+private:
+	int window, pffInterval, frameCount;
+	vector<Process*> admitted;
+	set<Process*> swappedOut;
+	uint64_t suspensions, resumes;
+	int peakDemand;
+
+public:
+	LoadController( int window, int pffInterval, int frameCount )
+		: window(window), pffInterval(pffInterval), frameCount(frameCount), suspensions(0), resumes(0), peakDemand(0) {}
+
+	//Returns the working set window size
+	int getWindow(){ return window; }
+
+	//Returns the total working set of the admitted processes
+	int demand(){
+		int total = 0;
+		for( size_t i = 0; i < admitted.size(); ++i ){ total += admitted[i]->getWorkingSetSize(); }
+		return total;
+	}
+
+	//True if the process' working set fits next to the admitted ones. Something always has to run
+	bool canAdmit( Process* current ){
+		return admitted.empty() || demand() + max( current->getWorkingSetSize(), 1 ) <= frameCount;
+	}
+
+	void admit( Process* current ){
+		admitted.push_back( current );
+		if( swappedOut.erase( current ) > 0 ){ resumes++; }
+		peakDemand = max( peakDemand, demand() );
+	}
+
+	//Removes a finished or swapped out process from the admitted set
+	void release( Process* current ){
+		admitted.erase( remove( admitted.begin(), admitted.end(), current ), admitted.end() );
+	}
+
+	//Called on a fault. True if the process should be swapped out instead of given another frame
+	bool shouldSuspend( Process* current ){
+		int interval = current->takeFaultInterval();
+		peakDemand = max( peakDemand, demand() );
+		if( interval >= pffInterval || admitted.size() <= 1 || demand() <= frameCount ){ return false; }
+		release( current );
+		swappedOut.insert( current );
+		suspensions++;
+		return true;
+	}
+
+	//Display load control totals
+	void displayStats( int elapsedTime ){
+		cout << "Load control: " << suspensions << " suspensions; " << resumes << " resumes; Peak demand: " 
+			 << peakDemand << "/" << frameCount << " frames; Ticks: " << elapsedTime << endl;
+	}
+};
+
+
 class Scheduler{
-private:
+protected:
 	Process* running;
 	deque<Process*> arrivals;
 	deque<Process*> ready;
 	deque<Process*> blocked;
-	int missPenalty, dirtyPagePenalty, elapsedTime;
+	deque<Process*> suspended;	//Swapped out by load control, waiting for their working set to fit
+	int missPenalty, dirtyPagePenalty, cowPenalty, elapsedTime;
 	Clock* MMU;
+	WritebackDaemon* cleaner;	//NULL when background writeback is off
+	Prefetcher* prefetcher;		//NULL when read-ahead is off
+	LoadController* controller;	//NULL when load control is off
+	int hugePromoteThreshold;	//Faulted pages in a region before it gets a huge frame (0 when huge pages are off)
+	CompressedPool* pool;		//NULL when there's no compressed tier
+	int zswapPenalty;			//Fault penalty for a page decompressed from the pool
+	NumaTopology* numa;			//NULL when memory is a single node
 	bool debug;
+	bool verbose;				//Print every reference
+	uint64_t faults, dirtyFaults, faultLatency, hugeFaults;
+
+	struct FaultTotals{
+		uint64_t faults, dirtyFaults, latency;
+		FaultTotals() : faults(0), dirtyFaults(0), latency(0) {}
+	};
+	map<int, FaultTotals> faultsByPID;
 
 public:
-	Scheduler( deque<Process*>& arrivals, int missPenalty, int dirtyPagePenalty, Clock* MMU, bool debug ) 
-		: running(NULL), arrivals(arrivals), missPenalty(missPenalty), dirtyPagePenalty(dirtyPagePenalty), MMU(MMU), debug(debug) {}
+	Scheduler( deque<Process*>& arrivals, int missPenalty, int dirtyPagePenalty, int cowPenalty, Clock* MMU, WritebackDaemon* cleaner, Prefetcher* prefetcher, 
+			   LoadController* controller, int hugePromoteThreshold, CompressedPool* pool, int zswapPenalty, 
+			   NumaTopology* numa, bool debug ) 
+		: running(NULL), arrivals(arrivals), missPenalty(missPenalty), dirtyPagePenalty(dirtyPagePenalty), cowPenalty(cowPenalty), elapsedTime(0), MMU(MMU), 
+		  cleaner(cleaner), prefetcher(prefetcher), controller(controller), hugePromoteThreshold(hugePromoteThreshold), 
+		  pool(pool), zswapPenalty(zswapPenalty), numa(numa), debug(debug), verbose(true),
+		  faults(0), dirtyFaults(0), faultLatency(0), hugeFaults(0) {}
+
+	virtual ~Scheduler(){}
 	
 	//Display entry info
 	void displayEntry( PageTableEntry* currentEntry, string placementType ){
+		if( !verbose ){ return; }
 		cout << "R/W: "	<< (currentEntry->dirtyBit ? 'W' : 'R' )
 						<< "; VA: "     <<  currentEntry->addr
 						<< "; Page: "   <<  currentEntry->page
@@ -247,22 +1573,217 @@ public:
 
 	}
 
+	//Returns true if the placement had to evict a dirty frame
+	bool evictedDirty( string& placementType ){
+		return placementType.size() >= 5 && placementType.compare( placementType.size() - 5, 5, "Dirty" ) == 0;
+	}
+
+	//Returns how long a fault with the given placement blocks the process
+	//Mapping a page that's already in memory is free, copy-on-write only pays for the copy
+	int faultPenalty( string& placementType ){
+		int penalty;
+		if( placementType == "Shared" || placementType == "CoW Reuse" ){ penalty = 0; }
+		else if( placementType.compare( 0, 4, "CoW " ) == 0 ){ penalty = cowPenalty; }
+		else{ penalty = missPenalty; }
+		if( evictedDirty( placementType ) ){ penalty += dirtyPagePenalty; }
+		return penalty;
+	}
+
+	//Gives the faulting page's region a huge frame once enough of it has faulted.
+	//Returns false if the region isn't dense enough yet or can't be promoted
+	bool tryPromote( PageTableEntry* currentEntry, int& dirtyEvictions, int& pagesRead ){
+		int ratio = MMU->getHugeRatio();
+		int region = currentEntry->page / ratio;
+		if( running->touchRegion( currentEntry->page, ratio ) < hugePromoteThreshold ){ return false; }
+
+		vector<PageTableEntry*> regionEntries;
+		if( !running->getRegionEntries( region, ratio, regionEntries ) ){ return false; }
+
+		//No group was usable. The region has to fault its way back up to the threshold before it tries again
+		if( MMU->promoteRegion( regionEntries, dirtyEvictions, pagesRead ) < 0 ){
+			running->resetRegion( region );
+			return false;
+		}
+
+		for( int i = 0; i < ratio; ++i ){ running->mapPage( region*ratio + i, regionEntries[i]->frame ); }
+		running->resetRegion( region );
+		hugeFaults++;
+		return true;
+	}
+
+	//Charges an access to the node it crosses to, and moves the page over if it keeps being accessed remotely
+	void recordNumaAccess( PageTableEntry* currentEntry ){
+		if( !numa->recordAccess( running->getPID(), currentEntry->frame ) ){ return; }
+
+		string placementType;
+		int newFrame = MMU->migrate( *currentEntry, numa->getRunNode( running->getPID() ), placementType );
+		if( newFrame < 0 ){ return; }
+		currentEntry->frame = newFrame;
+		running->mapPage( currentEntry->page, newFrame );
+		//The process doesn't block for a migration, so its write goes to the NUMA overhead rather than the fault totals
+		if( evictedDirty( placementType ) ){ numa->recordMigrationWrite( dirtyPagePenalty ); }
+		if( debug ){ displayEntry( currentEntry, "Migrated " + placementType ); }
+	}
+
+	//Handles a reference that's already in memory
+	void handleHit( PageTableEntry* currentEntry ){
+		displayEntry( currentEntry, "Hit" );
+		MMU->setReferenced( currentEntry->frame ); //Update ref bit in clock
+		if( prefetcher != NULL ){ prefetcher->onHit( running, currentEntry ); }
+		if( controller != NULL ){ running->recordReference( currentEntry->page, controller->getWindow() ); }
+
+
+		//If the reference was a write, we need to make sure to flag the frame as "dirty"
+		if( currentEntry->dirtyBit ){
+			MMU->setDirty( currentEntry->frame );
+		}
+		if( numa != NULL ){ recordNumaAccess( currentEntry ); }
+	}
+
+	//Finds the faulting reference a spot in memory and sets how long the running process has to wait for it
+	void handleFault( PageTableEntry* currentEntry ){
+		string placementType;
+		int hugeDirtyEvictions = 0, hugePagesRead = 0;
+		uint64_t dirtyBefore = dirtyFaults;
+		currentEntry->refBit = 1;
+		bool compressedDirty = false;
+		bool decompressed = pool != NULL && !currentEntry->shared && pool->load( running->getPID(), currentEntry->page, compressedDirty );
+		if( currentEntry->shared ){
+			placementType = MMU->findSharedMemory( *currentEntry );
+			if( !currentEntry->shared ){ running->privatizePage( currentEntry->page ); }
+		}
+		else if( hugePromoteThreshold > 0 && tryPromote( currentEntry, hugeDirtyEvictions, hugePagesRead ) ){ placementType = "Huge"; }
+		else{ placementType = MMU->findOpenMemory( *currentEntry ); }
+		
+		//Other references of the same page must be notified that they have a spot in physical mem now
+		running->mapPage( currentEntry->page, currentEntry->frame );
+		if( compressedDirty ){ MMU->setDirty( currentEntry->frame ); }
+
+		//Apply penalty time as see fit
+		displayEntry( currentEntry, decompressed ? "Zswap " + placementType : placementType );
+		running->setWaitTime( faultPenalty( placementType ) );
+		if( evictedDirty( placementType ) ){ dirtyFaults++; }
+		//A promotion reads in every region page that wasn't resident, not just the faulting one
+		if( placementType == "Huge" ){
+			running->setWaitTime( running->getWaitTime() + (hugePagesRead - 1)*missPenalty + hugeDirtyEvictions*dirtyPagePenalty );
+			dirtyFaults += hugeDirtyEvictions;
+		}
+
+		//Decompressing is cheaper than reading the page, but dirty pages the pool spilled had to be written first
+		if( decompressed ){ running->setWaitTime( running->getWaitTime() - missPenalty + zswapPenalty ); }
+		if( pool != NULL ){
+			int spillWrites = pool->takePendingWrites();
+			running->setWaitTime( running->getWaitTime() + spillWrites*dirtyPagePenalty );
+			dirtyFaults += spillWrites;
+		}
+
+		//Read-ahead shares the blocked interval, but dirty frames it evicts still have to be written
+		if( prefetcher != NULL ){
+			running->setWaitTime( running->getWaitTime() + prefetcher->onFault( running, currentEntry, MMU, dirtyPagePenalty, debug ) );
+		}
+		faults++;
+		faultLatency += running->getWaitTime();
+
+		FaultTotals& totals = faultsByPID[running->getPID()];
+		totals.faults++;
+		totals.dirtyFaults += dirtyFaults - dirtyBefore;
+		totals.latency += running->getWaitTime();
+	}
+
+	//Swaps the running process out. Its dirty frames are written back first, which it waits for
+	//once it's let back in, and every page has to fault in again when it resumes
+	void suspendProcess(){
+		if( verbose ){ cout << "Suspending " << running->getPID() << endl; }
+		if( prefetcher != NULL ){ prefetcher->onExit( running ); }
+		int dirtyFrames = MMU->clearPID( running->getPID() );
+		running->invalidatePages();
+		running->setWaitTime( dirtyFrames*dirtyPagePenalty );
+		dirtyFaults += dirtyFrames;
+		suspended.push_back( running );
+	}
+
+	//The process is finished with all references! Make sure to "clean" out the pages it used up in physical memory
+	void finishProcess(){
+		MMU->clearPID( running->getPID() );
+		if( pool != NULL ){ pool->dropPID( running->getPID() ); }
+		if( prefetcher != NULL ){ prefetcher->onExit( running ); }
+		if( controller != NULL ){ controller->release( running ); }
+	}
+
+	//Queues a process that's ready to run
+	virtual void makeReady( Process* process ){ ready.push_back( process ); }
+
+	//What happens every tick before a process is dispatched: the cleaner runs, the next process arrives,
+	//and with load control one swapped out process may be let back in. Returns the process that arrived, if any
+	Process* tickArrivals(){
+		Process* arrived = NULL;
+
+		//The cleaner works in the background every tick
+		if( cleaner != NULL ){ cleaner->tick( MMU, debug ); }
+
+		//If it's time for a process to be ready, put it in the ready queue
+		//With load control on, it has to wait with the swapped out processes until it fits
+		if( arrivals.size() > 0 ){
+			arrived = arrivals.front();
+			if( controller != NULL ){ suspended.push_back( arrived ); }
+			else{ makeReady( arrived ); }
+			arrivals.pop_front();
+		}
+
+		//Let the next swapped out process back in once its working set fits
+		if( controller != NULL && suspended.size() > 0 && controller->canAdmit( suspended.front() ) ){
+			controller->admit( suspended.front() );
+			if( debug ){ cout << "Admitting " << suspended.front()->getPID() << endl; }
+
+			//It can't run until the dirty pages it was swapped out with are written
+			if( suspended.front()->getWaitTime() > 0 ){ blocked.push_back( suspended.front() ); }
+			else{ makeReady( suspended.front() ); }
+			suspended.pop_front();
+		}
+		return arrived;
+	}
+
+	//True if an optional subsystem is on, so there are totals worth reporting
+	bool hasStats(){
+		return cleaner != NULL || prefetcher != NULL || controller != NULL || hugePromoteThreshold > 0 || pool != NULL || numa != NULL;
+	}
+
+	//Display fault totals and whatever the optional subsystems collected
+	virtual void displayStats(){
+		cout << "Faults: " << faults << "; Dirty evictions: " << dirtyFaults << "; Fault latency: " << faultLatency << endl;
+		if( hugePromoteThreshold > 0 ){
+			cout << "Faults by page size: " << faults - hugeFaults << " base; " << hugeFaults << " huge" << endl;
+			MMU->displayHugePageStats();
+		}
+		if( pool != NULL ){
+			pool->displayStats( MMU->getFrameCount() );
+			cout << "Average fault latency: " << (faults > 0 ? double(faultLatency) / faults : 0.0) << endl;
+		}
+		if( numa != NULL ){ numa->displayStats(); }
+		if( cleaner != NULL ){
+			cleaner->displayStats();
+
+			//Per process, to see who the cleaner saved the dirty penalty for (run with writebackBandwidth=0 to compare)
+			for( map<int, FaultTotals>::iterator it = faultsByPID.begin(); it != faultsByPID.end(); ++it ){
+				cout << "Process " << it->first << ": " << it->second.faults << " faults; " << it->second.dirtyFaults << " dirty evictions; Fault latency: "
+					 << it->second.latency << "; " << cleaner->getPagesWritten( it->first ) << " pages written back" << endl;
+			}
+		}
+		if( prefetcher != NULL ){ prefetcher->displayStats(); }
+		if( controller != NULL ){ controller->displayStats( elapsedTime ); }
+	}
+
 	//Modified FIFO process scheduler algorithm
-	void run(){
+	virtual void run(){
 		if( arrivals.size() == 0 ){ return; }
 
-		PageTable* currentTable;
 		PageTableEntry* currentEntry;
-		string placementType;
 		bool faulted; 
 
-		while( arrivals.size() > 0 || ready.size() > 0 || blocked.size() > 0 ){
+		while( arrivals.size() > 0 || ready.size() > 0 || blocked.size() > 0 || suspended.size() > 0 ){
 
-			//If it's time for a process to be ready, put it in the ready queue
-			if( arrivals.size() > 0 ){
-				ready.push_back( arrivals.front() );
-				arrivals.pop_front();
-			}
+			tickArrivals();
+			elapsedTime++;
 
 			
 			//After waiting in the blocked stage, return to waiting
@@ -282,9 +1803,9 @@ public:
 				running = ready.front();
 				ready.pop_front();
 				cout << "Running " << running->getPID() << endl;
+				if( numa != NULL ){ numa->onDispatch( running->getPID() ); }
 
 				//Let's get the next table entry
-				currentTable = running->getPageTable();
 				currentEntry = running->nextTableEntry();
 
 				//== Before anything, see if the current reference is in physical memory. ==
@@ -301,44 +1822,25 @@ public:
 					}
 
 					//If you didn't fault, that means the reference is good to go! You've got a hit
-					placementType = "Hit";
-					displayEntry( currentEntry, placementType );
-					MMU->getFrameEntryAt( currentEntry->frame )->refBit = 1; //Update ref bit in clock
-
-
-					//If the reference was a write, we need to make sure to flag the entry as "dirty"
-					if( currentEntry->dirtyBit ){
-						MMU->getFrameEntryAt( currentEntry->frame )->dirtyBit = currentEntry->dirtyBit;
-					}
+					handleHit( currentEntry );
 
 					running->incrementNext();
 					currentEntry = running->nextTableEntry();
 
 					//If the currentEntry becomes NULL, then the process is finished with all references!
 					//Make sure to "clean" out the pages it used up in physical memory
-					if( currentEntry == NULL ){
-						MMU->clearPID( running->getPID() );
-					}
+					if( currentEntry == NULL ){ finishProcess(); }
 
 				}
 
-				//If it isn't, it needs to be blocked and find one
-				if( currentEntry != NULL && currentEntry->validBit == 0 ){
-					currentEntry->refBit = 1;
-					placementType = MMU->findOpenMemory( *currentEntry );
-					
-					//Other references of the same page must be notified that they have a spot in physical mem now
-					for( int i = 0; currentTable->pages[i] != NULL && i < currentTable->pages.size(); ++i ){
-						if( currentTable->pages[i]->page == currentEntry->page ){
-							currentTable->pages[i]->validBit = 1;
-							currentTable->pages[i]->frame = currentEntry->frame;
-						}
-					}
+				//If it's faulting too often while memory is overcommitted, swap it out instead
+				if( currentEntry != NULL && currentEntry->validBit == 0 && controller != NULL && controller->shouldSuspend( running ) ){
+					suspendProcess();
+				}
 
-					//Apply penalty time as see fit
-					displayEntry( currentEntry, placementType );
-					if( placementType == "Dirty" ) { running->setWaitTime( missPenalty + dirtyPagePenalty ); }
-					else{ running->setWaitTime( missPenalty ); }
+				//If it isn't, it needs to be blocked and find one
+				else if( currentEntry != NULL && currentEntry->validBit == 0 ){
+					handleFault( currentEntry );
 					blocked.push_back( running );
 
 				}
@@ -359,12 +1861,456 @@ public:
 
 
 		}
+
+		if( hasStats() ){ displayStats(); }
+	}
+};
+
+
+//Runs the memory simulation under a CPU scheduler. Every tick the running process executes one
+//reference of its trace, so a CPU burst lasts until the next page fault, and the fault sends the
+//process to the waiting stage for as long as the fault takes (one paging device, served in order).
+//	Policies
+//		FCFS	(A process runs until it faults or finishes)
+//		CTSS	(Multilevel feedback queues. Level i has a quantum of 2^i ticks. A process that uses up its
+//				 quantum drops a level, one that faults within half of it rises a level, and a process
+//				 waiting at a higher level preempts the running one)
+class CpuScheduler : public Scheduler{
+private:
+	struct CpuState{
+		int priorityLevel, guaranteedTime, burstInterval, arrivalTime;
+		CpuState() : priorityLevel(0), guaranteedTime(1), burstInterval(0), arrivalTime(0) {}
+	};
+
+	bool ctss;
+	int contextSwitchDelay;
+	vector< deque<Process*> > readyQueues;	//One per CTSS level. FCFS only uses the first
+	map<Process*, CpuState> cpuStates;
+	uint64_t busyTicks, contextSwitches, readyWaitTicks, turnaroundTotal;
+	int completed;
+
+public:
+	CpuScheduler( deque<Process*>& arrivals, int missPenalty, int dirtyPagePenalty, int cowPenalty, Clock* MMU, WritebackDaemon* cleaner, Prefetcher* prefetcher, 
+				  LoadController* controller, int hugePromoteThreshold, CompressedPool* pool, int zswapPenalty, NumaTopology* numa, 
+				  bool ctss, int ctssQueues, int contextSwitchDelay, bool debug ) 
+		: Scheduler( arrivals, missPenalty, dirtyPagePenalty, cowPenalty, MMU, cleaner, prefetcher, controller, hugePromoteThreshold, pool, zswapPenalty, numa, debug ),
+		  ctss(ctss), contextSwitchDelay(contextSwitchDelay), readyQueues( ctss ? max( ctssQueues, 1 ) : 1 ),
+		  busyTicks(0), contextSwitches(0), readyWaitTicks(0), turnaroundTotal(0), completed(0) {
+		verbose = debug;
+	}
+
+	//Ticks a process at the given level gets before it drops a level
+	int quantum( int priorityLevel ){ return 1 << priorityLevel; }
+
+	//Returns the highest priority level with a ready process, or the number of levels if there isn't one
+	int highestReadyLevel(){
+		for( size_t i = 0; i < readyQueues.size(); ++i ){
+			if( readyQueues[i].size() > 0 ){ return int(i); }
+		}
+		return int( readyQueues.size() );
+	}
+
+	//Starts a new burst for the process and queues it at its level
+	void makeReady( Process* process ){
+		CpuState& state = cpuStates[process];
+		state.burstInterval = 0;
+		state.guaranteedTime = quantum( state.priorityLevel );
+		readyQueues[ctss ? state.priorityLevel : 0].push_back( process );
+	}
+
+	//Executes one reference of the running process. Leaves running NULL if the process gave up the CPU
+	void executeReference(){
+		CpuState& state = cpuStates[running];
+		PageTableEntry* currentEntry = running->nextTableEntry();
+		busyTicks++;
+		state.burstInterval++;
+		state.guaranteedTime--;
+
+		//The frame may have been taken since the page was mapped
+		if( currentEntry != NULL && currentEntry->validBit == 1 && MMU->checkPageFault( currentEntry ) ){ currentEntry->validBit = 0; }
+
+		//A fault ends the burst. If it's faulting too often while memory is overcommitted, swap it out instead
+		if( currentEntry != NULL && currentEntry->validBit == 0 ){
+			if( controller != NULL && controller->shouldSuspend( running ) ){
+				suspendProcess();
+				running = NULL;
+				return;
+			}
+
+			handleFault( currentEntry );
+			if( ctss && state.priorityLevel > 0 && state.burstInterval <= quantum( state.priorityLevel )/2 ){ state.priorityLevel--; }
+			blocked.push_back( running );
+			running = NULL;
+			return;
+		}
+
+		if( currentEntry != NULL ){
+			handleHit( currentEntry );
+			running->incrementNext();
+		}
+		if( running->nextTableEntry() == NULL ){
+			if( verbose ){ cout << "Finished " << running->getPID() << endl; }
+			finishProcess();
+			completed++;
+			turnaroundTotal += elapsedTime + 1 - state.arrivalTime;
+			running = NULL;
+			return;
+		}
+		if( !ctss ){ return; }
+
+		//A process waiting at a higher level preempts this one, which keeps its place at the front of its level
+		if( highestReadyLevel() < state.priorityLevel ){
+			state.burstInterval = 0;
+			readyQueues[state.priorityLevel].push_front( running );
+			running = NULL;
+		}
+
+		//If the quantum has been used up, move the running process down a priority level
+		else if( state.guaranteedTime <= 0 ){
+			if( state.priorityLevel < int(readyQueues.size()) - 1 ){ state.priorityLevel++; }
+			state.guaranteedTime = quantum( state.priorityLevel );
+			state.burstInterval = 0;
+			readyQueues[state.priorityLevel].push_back( running );
+			running = NULL;
+		}
+	}
+
+	void run(){
+		if( arrivals.size() == 0 ){ return; }
+
+		bool switching = false;		//The CPU sits idle for a context switch after a process leaves it
+		int idleTime = 0;
+
+		while( arrivals.size() > 0 || highestReadyLevel() < int(readyQueues.size()) || blocked.size() > 0 || suspended.size() > 0 || running != NULL ){
+
+			//One arrival per tick, as in the memory scheduler
+			Process* arrived = tickArrivals();
+			if( arrived != NULL ){ cpuStates[arrived].arrivalTime = elapsedTime; }
+
+			//The front of the waiting stage gets its page once its fault has taken its time
+			if( blocked.size() > 0 ){
+				if( blocked.front()->getWaitTime() == 0 ){
+					makeReady( blocked.front() );
+					blocked.pop_front();
+				}
+				else{ blocked.front()->decrementWait(); }
+			}
+
+			//Nothing can enter running until the context switch is over
+			if( switching && running == NULL && ++idleTime >= contextSwitchDelay ){
+				switching = false;
+				idleTime = 0;
+			}
+
+			if( running != NULL ){
+				executeReference();
+				if( running == NULL && contextSwitchDelay > 0 ){ switching = true; }
+			}
+
+			//If there's a process ready to be put into the running stage and it is open, let it run!
+			int level = highestReadyLevel();
+			if( running == NULL && !switching && level < int(readyQueues.size()) ){
+				running = readyQueues[level].front();
+				readyQueues[level].pop_front();
+				contextSwitches++;
+				if( verbose ){ cout << "Running " << running->getPID() << endl; }
+				if( numa != NULL ){ numa->onDispatch( running->getPID() ); }
+			}
+
+			for( size_t i = 0; i < readyQueues.size(); ++i ){ readyWaitTicks += readyQueues[i].size(); }
+			elapsedTime++;
+		}
+	}
+
+	//Display CPU and memory totals together
+	void displayStats(){
+		cout << "Time: " << elapsedTime << "; CPU busy: " << busyTicks << " (" << getUtilization() << "%); Context switches: " << contextSwitches << endl;
+		cout << "Completed: " << completed << "; Throughput: " << getThroughput() << " per 1000 ticks; Average turnaround: " << getAverageTurnaround() 
+			 << "; Average ready wait: " << getAverageReadyWait() << endl;
+		Scheduler::displayStats();
+	}
+
+	//One tab separated row of the headline numbers, for sweeps
+	void displaySummary( string label ){
+		cout << label << "\t" << elapsedTime << "\t" << getUtilization() << "\t" << getThroughput() << "\t" << getAverageTurnaround() << "\t" 
+			 << getAverageReadyWait() << "\t" << faults << "\t" << dirtyFaults << "\t" << (faults > 0 ? double(faultLatency) / faults : 0.0) << endl;
+	}
+
+	double getUtilization(){ return elapsedTime > 0 ? 100.0 * busyTicks / elapsedTime : 0.0; }
+	double getThroughput(){ return elapsedTime > 0 ? 1000.0 * completed / elapsedTime : 0.0; }
+	double getAverageTurnaround(){ return completed > 0 ? double(turnaroundTotal) / completed : 0.0; }
+	double getAverageReadyWait(){ return completed > 0 ? double(readyWaitTicks) / completed : 0.0; }
+};
+
+
+//Blocks each worker until all of them have arrived
+class Barrier{
+private:
+	mutex lock;
+	condition_variable released;
+	int count, waiting, generation;
+
+public:
+	Barrier( int count ) : count(count), waiting(0), generation(0) {}
+
+	void wait(){
+		unique_lock<mutex> guard( lock );
+		int arrivedGeneration = generation;
+		if( ++waiting == count ){
+			waiting = 0;
+			generation++;
+			released.notify_all();
+		}
+		else{
+			while( arrivedGeneration == generation ){ released.wait( guard ); }
+		}
+	}
+};
+
+
+//Per process results of a threaded run
+struct ProcessStats{
+	int pid;
+	uint64_t hits, faults, dirtyFaults, stallTime;
+	ProcessStats( int pid ) : pid(pid), hits(0), faults(0), dirtyFaults(0), stallTime(0) {}
+};
+
+
+//Runs the simulated processes on real worker threads against one shared ConcurrentClock.
+//	Free running:	workers pull processes off a shared queue, run them up to their next fault,
+//					service the fault and put them back. Replacement order depends on the OS scheduler.
+//	Deterministic:	workers run in rounds. All processes run their hits in parallel, then the faults
+//					of that round are serviced one at a time in an order shuffled by the seed.
+class ThreadedScheduler{
+private:
+	deque<Process*> processes;
+	vector<ProcessStats> stats;
+	int missPenalty, dirtyPagePenalty, numThreads;
+	bool deterministic;
+	ConcurrentClock* MMU;
+
+	//Free running state
+	mutex queueLock;
+	deque<int> workQueue;
+	atomic<int> remaining;
+
+	//Deterministic state
+	mt19937 rng;
+	vector<int> active;
+	vector<PageTableEntry*> faults;
+	bool finished;
+
+public:
+	ThreadedScheduler( deque<Process*>& processes, int missPenalty, int dirtyPagePenalty, ConcurrentClock* MMU, int numThreads, bool deterministic, unsigned int seed )
+		: processes(processes), missPenalty(missPenalty), dirtyPagePenalty(dirtyPagePenalty), numThreads(numThreads), 
+		  deterministic(deterministic), MMU(MMU), remaining(0), rng(seed), finished(false) {
+		for( size_t i = 0; i < processes.size(); ++i ){ stats.push_back( ProcessStats(processes[i]->getPID()) ); }
+	}
+
+
+	//Runs the process' references until one faults. Returns the faulting entry, or NULL if the process is done
+	PageTableEntry* runUntilFault( Process* current, ProcessStats& currentStats ){
+		PageTableEntry* currentEntry = current->nextTableEntry();
+		while( currentEntry != NULL && currentEntry->validBit == 1 ){
+			if( MMU->checkPageFault( currentEntry ) ){
+				currentEntry->validBit = 0;
+				break;
+			}
+
+			currentStats.hits++;
+			MMU->setReferenced( currentEntry->frame );
+			if( currentEntry->dirtyBit ){ MMU->setDirty( currentEntry->frame ); }
+
+			current->incrementNext();
+			currentEntry = current->nextTableEntry();
+		}
+		return currentEntry;
+	}
+
+
+	//Brings the faulting page into memory and charges the process for it
+	void serviceFault( Process* current, PageTableEntry* currentEntry, ProcessStats& currentStats ){
+		currentEntry->refBit = 1;
+		string placementType = MMU->findOpenMemory( *currentEntry );
+		current->mapPage( currentEntry->page, currentEntry->frame );
+
+		currentStats.faults++;
+		if( placementType == "Dirty" ){
+			currentStats.dirtyFaults++;
+			currentStats.stallTime += missPenalty + dirtyPagePenalty;
+		}
+		else{ currentStats.stallTime += missPenalty; }
+	}
+
+
+	//Free running worker
+	void freeWorker(){
+		while( remaining.load() > 0 ){
+			int index;
+			{
+				lock_guard<mutex> guard( queueLock );
+				if( workQueue.empty() ){ index = -1; }
+				else{ index = workQueue.front(); workQueue.pop_front(); }
+			}
+			if( index < 0 ){ this_thread::yield(); continue; }
+
+			PageTableEntry* currentEntry = runUntilFault( processes[index], stats[index] );
+			if( currentEntry == NULL ){
+				MMU->clearPID( processes[index]->getPID() );
+				remaining.fetch_sub( 1 );
+				continue;
+			}
+			serviceFault( processes[index], currentEntry, stats[index] );
+
+			lock_guard<mutex> guard( queueLock );
+			workQueue.push_back( index );
+		}
+	}
+
+
+	//Deterministic worker. Worker 0 also services the round's faults
+	void roundWorker( int workerId, Barrier* barrier ){
+		while( true ){
+			for( size_t i = workerId; i < active.size(); i += numThreads ){
+				faults[i] = runUntilFault( processes[active[i]], stats[active[i]] );
+			}
+			barrier->wait();
+
+			if( workerId == 0 ){
+				vector<int> order, stillActive;
+				for( size_t i = 0; i < active.size(); ++i ){
+					if( faults[i] == NULL ){ MMU->clearPID( processes[active[i]]->getPID() ); }
+					else{ order.push_back( int(i) ); }
+				}
+				shuffle( order.begin(), order.end(), rng );
+				for( size_t i = 0; i < order.size(); ++i ){
+					int index = active[order[i]];
+					serviceFault( processes[index], faults[order[i]], stats[index] );
+				}
+				for( size_t i = 0; i < active.size(); ++i ){
+					if( faults[i] != NULL ){ stillActive.push_back( active[i] ); }
+				}
+				active.swap( stillActive );
+				faults.assign( active.size(), NULL );
+				finished = active.empty();
+			}
+			barrier->wait();
+			if( finished ){ return; }
+		}
+	}
+
+
+	void run(){
+		if( processes.size() == 0 ){ return; }
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		vector<thread> workers;
+		Barrier barrier( numThreads );
+
+		if( deterministic ){
+			for( size_t i = 0; i < processes.size(); ++i ){ active.push_back( int(i) ); }
+			faults.assign( active.size(), NULL );
+			for( int i = 0; i < numThreads; ++i ){ workers.push_back( thread( &ThreadedScheduler::roundWorker, this, i, &barrier ) ); }
+		}
+		else{
+			for( size_t i = 0; i < processes.size(); ++i ){ workQueue.push_back( int(i) ); }
+			remaining = int( processes.size() );
+			for( int i = 0; i < numThreads; ++i ){ workers.push_back( thread( &ThreadedScheduler::freeWorker, this ) ); }
+		}
+		for( size_t i = 0; i < workers.size(); ++i ){ workers[i].join(); }
+
+		double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+		displayStats( seconds );
+	}
+
+
+	//Display per process and total results
+	void displayStats( double seconds ){
+		ProcessStats total( 0 );
+		cout << "PID\tHits\tFaults\tDirty\tStall" << endl;
+		for( size_t i = 0; i < stats.size(); ++i ){
+			cout << stats[i].pid << "\t" << stats[i].hits << "\t" << stats[i].faults 
+				 << "\t" << stats[i].dirtyFaults << "\t" << stats[i].stallTime << endl;
+			total.hits += stats[i].hits;
+			total.faults += stats[i].faults;
+			total.dirtyFaults += stats[i].dirtyFaults;
+			total.stallTime += stats[i].stallTime;
+		}
+		cout << "Total\t" << total.hits << "\t" << total.faults << "\t" << total.dirtyFaults << "\t" << total.stallTime << endl;
+		cout << "Threads: " << numThreads << (deterministic ? " (deterministic)" : "") << endl;
+		cout << "Hand advances: " << MMU->getHandAdvances() << "; Claim collisions: " << MMU->getClaimCollisions() << endl;
+		cout << "Wall time: " << seconds << "s" << endl;
 	}
 };
 
 
+//Settings for the optional simulation modes. The defaults run the original single threaded scheduler
+struct MemoryOptions{
+	int threads;
+	bool deterministic;
+	unsigned int seed;
+	bool writeback;
+	int writebackBandwidth, writebackMaxBatch, writebackHighWatermark, writebackLowWatermark;
+	bool prefetch;
+	int prefetchMaxWindow;
+	bool loadControl;
+	int workingSetWindow, pffInterval;
+	set<int> sharedPages;
+	int cowPenalty;
+	int hugePageSize, hugePromoteThreshold;
+	int zswapSize, zswapPenalty;
+	double zswapRatio;
+	int numaNodes;
+	bool numaInterleave;
+	vector<int> numaDistances;
+	int numaRebalanceInterval, numaMigrateThreshold, numaMigratePenalty;
+	vector<string> cpuSchedulers;		//Empty runs the memory scheduler on its own
+	int ctssQueues, contextSwitchDelay;
+	vector<int> sweepPAbits;
+
+	MemoryOptions() : threads(1), deterministic(false), seed(0), 
+		writeback(false), writebackBandwidth(1), writebackMaxBatch(4), writebackHighWatermark(50), writebackLowWatermark(25),
+		prefetch(false), prefetchMaxWindow(8),
+		loadControl(false), workingSetWindow(100), pffInterval(10),
+		cowPenalty(1),
+		hugePageSize(0), hugePromoteThreshold(0),
+		zswapSize(0), zswapPenalty(0), zswapRatio(3.0),
+		numaNodes(1), numaInterleave(false), numaRebalanceInterval(0), numaMigrateThreshold(0), numaMigratePenalty(0),
+		ctssQueues(5), contextSwitchDelay(1) {}
+};
+
+
+//Reads a true/false setting value. Anything unrecognized leaves the current value alone
+bool readBoolValue( string& variableValue, bool current ){
+	if( variableValue == "0" || variableValue[0] == 'f' || variableValue[0] == 'F' ) { return false; }
+	else if ( variableValue == "1" || variableValue[0] == 't' || variableValue[0] == 'T' ){ return true; }
+	return current;
+}
+
+
+//Reads a comma separated list of values
+void readListValue( string& variableValue, vector<string>& values ){
+	values.clear();
+	size_t start = 0;
+	while( start < variableValue.size() ){
+		size_t comma = variableValue.find( ",", start );
+		if( comma == string::npos ){ comma = variableValue.size(); }
+		if( comma > start ){ values.push_back( variableValue.substr( start, comma - start ) ); }
+		start = comma + 1;
+	}
+}
+
+//Reads a comma separated list of numbers
+void readListValue( string& variableValue, vector<int>& values ){
+	vector<string> items;
+	readListValue( variableValue, items );
+	values.clear();
+	for( size_t i = 0; i < items.size(); ++i ){ values.push_back( atoi( items[i].c_str() ) ); }
+}
+
+
 //Retrieves all the variable values from the Memory Management file
-void readMemManagementFile( ifstream& memManagementFile, string& referenceFileName, int& missPenalty, int& dirtyPagePenalty, int& pageSize, int& VAbits, int& PAbits, bool& debug ){
+void readMemManagementFile( ifstream& memManagementFile, string& referenceFileName, int& missPenalty, int& dirtyPagePenalty, int& pageSize, int& VAbits, int& PAbits, bool& debug, MemoryOptions& options ){
 	string memManagementLine;
 	while( getline(memManagementFile, memManagementLine) ){
 		size_t foundEqual = memManagementLine.find("=");
@@ -384,12 +2330,57 @@ void readMemManagementFile( ifstream& memManagementFile, string& referenceFileNa
 			if( variableValue == "0" || variableValue[0] == 'f' || variableValue[0] == 'F' ) { debug = false; }
 			else if ( variableValue == "1" || variableValue[0] == 't' || variableValue[0] == 'T' ){ debug = true; }
 		}
+		else if( variableName == "threads" ){ options.threads = atoi( variableValue.c_str() ); }
+		else if( variableName == "deterministic" ){ options.deterministic = readBoolValue( variableValue, options.deterministic ); }
+		else if( variableName == "seed" ){ options.seed = (unsigned int)strtoul( variableValue.c_str(), NULL, 10 ); }
+		else if( variableName == "writeback" ){ options.writeback = readBoolValue( variableValue, options.writeback ); }
+		else if( variableName == "writebackbandwidth" ){ options.writebackBandwidth = atoi( variableValue.c_str() ); }
+		else if( variableName == "writebackmaxbatch" ){ options.writebackMaxBatch = atoi( variableValue.c_str() ); }
+		else if( variableName == "writebackhighwatermark" ){ options.writebackHighWatermark = atoi( variableValue.c_str() ); }
+		else if( variableName == "writebacklowwatermark" ){ options.writebackLowWatermark = atoi( variableValue.c_str() ); }
+		else if( variableName == "prefetch" ){ options.prefetch = readBoolValue( variableValue, options.prefetch ); }
+		else if( variableName == "prefetchmaxwindow" ){ options.prefetchMaxWindow = atoi( variableValue.c_str() ); }
+		else if( variableName == "loadcontrol" ){ options.loadControl = readBoolValue( variableValue, options.loadControl ); }
+		else if( variableName == "workingsetwindow" ){ options.workingSetWindow = atoi( variableValue.c_str() ); }
+		else if( variableName == "pffinterval" ){ options.pffInterval = atoi( variableValue.c_str() ); }
+		else if( variableName == "sharedpages" ){
+			//Comma separated page numbers mapped by every process that uses them
+			vector<int> pages;
+			readListValue( variableValue, pages );
+			options.sharedPages.insert( pages.begin(), pages.end() );
+		}
+		else if( variableName == "cowpenalty" ){ options.cowPenalty = atoi( variableValue.c_str() ); }
+		else if( variableName == "hugepagesize" ){ options.hugePageSize = atoi( variableValue.c_str() ); }
+		else if( variableName == "hugepromotethreshold" ){ options.hugePromoteThreshold = atoi( variableValue.c_str() ); }
+		else if( variableName == "zswapsize" ){ options.zswapSize = atoi( variableValue.c_str() ); }
+		else if( variableName == "zswappenalty" ){ options.zswapPenalty = atoi( variableValue.c_str() ); }
+		else if( variableName == "zswapratio" ){ options.zswapRatio = atof( variableValue.c_str() ); }
+		else if( variableName == "numanodes" ){ options.numaNodes = atoi( variableValue.c_str() ); }
+		else if( variableName == "numapolicy" ){ options.numaInterleave = ( tolower( variableValue[0] ) == 'i' ); }
+		else if( variableName == "numadistances" ){
+			//Row-major: the cost for a process on node i to access memory on node j
+			readListValue( variableValue, options.numaDistances );
+		}
+		else if( variableName == "numarebalanceinterval" ){ options.numaRebalanceInterval = atoi( variableValue.c_str() ); }
+		else if( variableName == "numamigratethreshold" ){ options.numaMigrateThreshold = atoi( variableValue.c_str() ); }
+		else if( variableName == "numamigratepenalty" ){ options.numaMigratePenalty = atoi( variableValue.c_str() ); }
+		else if( variableName == "cpuscheduler" ){
+			//fcfs and/or ctss. More than one (or more than one memory size) sweeps every combination
+			readListValue( variableValue, options.cpuSchedulers );
+			for( size_t j = 0; j < options.cpuSchedulers.size(); ++j ){
+				for( size_t k = 0; k < options.cpuSchedulers[j].size(); ++k ){ options.cpuSchedulers[j][k] = tolower( options.cpuSchedulers[j][k] ); }
+				if( options.cpuSchedulers[j] != "fcfs" && options.cpuSchedulers[j] != "ctss" ){ cout << "Unknown CPU scheduler: " << options.cpuSchedulers[j] << endl; exit(1); }
+			}
+		}
+		else if( variableName == "ctssqueues" ){ options.ctssQueues = atoi( variableValue.c_str() ); }
+		else if( variableName == "contextswitchdelay" ){ options.contextSwitchDelay = atoi( variableValue.c_str() ); }
+		else if( variableName == "sweeppabits" ){ readListValue( variableValue, options.sweepPAbits ); }
 	}
 }
 
 
-//Retrieves all the variable values from the references file
-void readReferenceFile( ifstream& referenceFile, deque<Process*>& processes, int pageSize, int VAbits ){
+//Reads the text reference file into per-process traces of packed words (addr << 1 | W)
+void parseReferenceText( ifstream& referenceFile, vector<int>& pids, vector< vector<uint64_t> >& traces ){
 	string referenceLine;
 	getline( referenceFile, referenceLine );
 	int numOfProcesses = atoi( referenceLine.c_str() );
@@ -398,7 +2389,7 @@ void readReferenceFile( ifstream& referenceFile, deque<Process*>& processes, int
 		int addr, pid, numOfReferences;
 		char type;
 		size_t foundSpace;
-		deque<Reference*> references;
+		vector<uint64_t> words;
 
 		getline( referenceFile, referenceLine );
 		while( referenceLine == "" ){ getline( referenceFile, referenceLine ); }
@@ -406,21 +2397,78 @@ void readReferenceFile( ifstream& referenceFile, deque<Process*>& processes, int
 
 		getline( referenceFile, referenceLine );
 		numOfReferences = atoi( referenceLine.c_str() );
+		words.reserve( numOfReferences );
 
 		for( int j = 0; j < numOfReferences; ++j ){
 			getline( referenceFile, referenceLine );
 			foundSpace = referenceLine.find(" ");
 			addr = atoi( referenceLine.substr( 0, foundSpace ).c_str() );
 			type = referenceLine.substr( foundSpace + 1 )[0];
-			references.push_back( new Reference(addr, type) );
+			words.push_back( packReference(addr, type) );
+		}
+		pids.push_back( pid );
+		traces.push_back( vector<uint64_t>() );
+		traces.back().swap( words );
+	}
+}
+
+
+//Creates a process for each decoded trace
+void buildProcesses( vector<int>& pids, vector< vector<uint64_t> >& traces, deque<Process*>& processes, int pageSize, int VAbits ){
+	for( size_t i = 0; i < pids.size(); ++i ){
+		deque<Reference*> references;
+		for( size_t j = 0; j < traces[i].size(); ++j ){
+			references.push_back( new Reference( unpackAddress(traces[i][j]), unpackType(traces[i][j]) ) );
 		}
-		processes.push_back( new Process(pid, 0, pageSize, VAbits, references) );
+		processes.push_back( new Process(pids[i], 0, pageSize, VAbits, references) );
 	}
 }
 
 
+//Retrieves all the variable values from the references file
+void readReferenceFile( ifstream& referenceFile, deque<Process*>& processes, int pageSize, int VAbits ){
+	vector<int> pids;
+	vector< vector<uint64_t> > traces;
+	parseReferenceText( referenceFile, pids, traces );
+	buildProcesses( pids, traces, processes, pageSize, VAbits );
+}
+
+
+//Retrieves all the processes from a binary trace file
+void readBinaryReferenceFile( string& referenceFileName, deque<Process*>& processes, int pageSize, int VAbits ){
+	vector<int> pids;
+	vector< vector<uint64_t> > traces;
+	if( !decodeTraceFile( referenceFileName, pids, traces ) ){ cout << "Could not decode binary reference file" << endl; exit(1); }
+	buildProcesses( pids, traces, processes, pageSize, VAbits );
+}
+
+
+//Converts a text reference file into the binary trace format. Returns false if either file can't be used
+bool convertReferenceFile( string& textFileName, string& binaryFileName ){
+	ifstream textFile( textFileName.c_str() );
+	if( !textFile ){ cout << "Could not open reference file" << endl; return false; }
+
+	vector<int> pids;
+	vector< vector<uint64_t> > traces;
+	parseReferenceText( textFile, pids, traces );
+
+	vector<unsigned char> encoded;
+	encodeTraceFile( pids, traces, encoded );
+
+	ofstream binaryFile( binaryFileName.c_str(), ios::binary );
+	if( !binaryFile ){ cout << "Could not open binary reference file" << endl; return false; }
+	binaryFile.write( (const char*)&encoded[0], encoded.size() );
+
+	textFile.clear();
+	textFile.seekg( 0, ios::end );
+	cout << "Converted " << textFileName << " (" << textFile.tellg() << " bytes) to "
+		 << binaryFileName << " (" << encoded.size() << " bytes)" << endl;
+	return true;
+}
+
+
 //Display all the values from the memory management file
-void displayMemFileInfo( string& referenceFileName, int& missPenalty, int& dirtyPagePenalty, int& pageSize, int& VAbits, int& PAbits, bool& debug ){
+void displayMemFileInfo( string& referenceFileName, int& missPenalty, int& dirtyPagePenalty, int& pageSize, int& VAbits, int& PAbits, bool& debug, MemoryOptions& options ){
 	cout << "Reference file: " << referenceFileName << endl;
 	cout << "Page size: " << pageSize << endl;
 	cout << "VA size: " << VAbits << endl;
@@ -428,6 +2476,27 @@ void displayMemFileInfo( string& referenceFileName, int& missPenalty, int& dirty
 	cout << "Miss penalty: " << missPenalty << endl;
 	cout << "Dirty page penalty: " << dirtyPagePenalty << endl;
 	cout << "Debug: " << debug << endl;
+	cout << "Threads: " << options.threads << endl;
+	cout << "Deterministic: " << options.deterministic << " (Seed: " << options.seed << ")" << endl;
+	cout << "Writeback: " << options.writeback << " (Bandwidth: " << options.writebackBandwidth << " batches of up to " << options.writebackMaxBatch << " pages"
+		 << "; Watermarks: " << options.writebackHighWatermark << "%/" << options.writebackLowWatermark << "%)" << endl;
+	cout << "Prefetch: " << options.prefetch << " (Max window: " << options.prefetchMaxWindow << ")" << endl;
+	cout << "Load control: " << options.loadControl << " (Working set window: " << options.workingSetWindow 
+		 << "; PFF interval: " << options.pffInterval << ")" << endl;
+	cout << "Shared pages: ";
+	for( set<int>::iterator it = options.sharedPages.begin(); it != options.sharedPages.end(); ++it ){ cout << *it << " "; }
+	cout << "(CoW penalty: " << options.cowPenalty << ")" << endl;
+	cout << "Huge page size: " << options.hugePageSize << " (Promote threshold: " << options.hugePromoteThreshold << ")" << endl;
+	cout << "Compressed pool: " << options.zswapSize << " bytes (Ratio: " << options.zswapRatio << "; Penalty: " << options.zswapPenalty << ")" << endl;
+	cout << "NUMA nodes: " << options.numaNodes << " (" << (options.numaInterleave ? "Interleave" : "First touch") << "; Distances: ";
+	for( size_t i = 0; i < options.numaDistances.size(); ++i ){ cout << options.numaDistances[i] << " "; }
+	cout << "; Rebalance interval: " << options.numaRebalanceInterval << "; Migrate threshold: " << options.numaMigrateThreshold 
+		 << "; Migrate penalty: " << options.numaMigratePenalty << ")" << endl;
+	cout << "CPU schedulers: ";
+	for( size_t i = 0; i < options.cpuSchedulers.size(); ++i ){ cout << options.cpuSchedulers[i] << " "; }
+	cout << "(CTSS queues: " << options.ctssQueues << "; Context switch delay: " << options.contextSwitchDelay << "; PAbits sweep: ";
+	for( size_t i = 0; i < options.sweepPAbits.size(); ++i ){ cout << options.sweepPAbits[i] << " "; }
+	cout << ")" << endl;
 }
 
 
@@ -444,27 +2513,145 @@ void displayRefFileInfo( deque<Process*> processes ){
 }
 
 
-int main(){
+//Runs the single threaded simulation over the processes with 2^PAbits bytes of physical memory.
+//An empty cpuScheduler runs the memory scheduler on its own, otherwise "fcfs" or "ctss" drives it.
+//A sweep prints just the summary row
+void runSimulation( deque<Process*>& processes, int missPenalty, int dirtyPagePenalty, int pageSize, int PAbits, bool debug, MemoryOptions& options, 
+					string cpuScheduler, bool sweep ){
+
+	//Pages shared between processes (single threaded scheduler only)
+	if( !options.sharedPages.empty() ){
+		for( size_t i = 0; i < processes.size(); ++i ){ processes[i]->markSharedPages( options.sharedPages ); }
+	}
+
+	//The compressed pool is carved out of physical memory, so it costs frames. It's capped so at least half
+	//the frames, and one per process, stay resident. Any fewer and the processes just evict each other's pages
+	int zswapSize = (options.zswapSize > 0 && options.zswapRatio > 1.0) ? options.zswapSize : 0;
+	int minFrames = max( int( pow(2, PAbits) / pageSize / 2 ), int( processes.size() ) );
+	int maxZswapSize = max( int( pow(2, PAbits) ) - minFrames*pageSize, 0 );
+	if( zswapSize > maxZswapSize ){
+		zswapSize = maxZswapSize;
+		cout << "Compressed pool capped at " << zswapSize << " bytes to keep " << minFrames << " frames" << endl;
+	}
+	PageTable frameTable = PageTable( (pow(2, PAbits) - zswapSize)/pageSize );
+	Clock MMU = Clock( &frameTable, debug );
+	CompressedPool pool( zswapSize, pageSize, options.zswapRatio );
+	if( zswapSize > 0 ){ MMU.setCompressedPool( &pool ); }
+
+	//Each node gets an equal share of the frames
+	int numaNodes = max( 1, min( options.numaNodes, frameTable.maxPages ) );
+	NumaTopology topology( numaNodes, frameTable.maxPages, options.numaInterleave, options.numaDistances, 
+						   options.numaRebalanceInterval, options.numaMigrateThreshold, options.numaMigratePenalty );
+	if( numaNodes > 1 ){ MMU.setTopology( &topology ); }
+
+	//Huge frames are a power of two multiple of the base page size. By default a region is promoted once half of it has faulted
+	int hugePromoteThreshold = 0;
+	if( options.hugePageSize > pageSize && options.hugePageSize % pageSize == 0 && ( (options.hugePageSize / pageSize) & (options.hugePageSize / pageSize - 1) ) == 0 ){
+		int ratio = options.hugePageSize / pageSize;
+		MMU.enableHugePages( ratio );
+		hugePromoteThreshold = (options.hugePromoteThreshold > 0) ? options.hugePromoteThreshold : max( ratio/2, 1 );
+	}
+	WritebackDaemon cleaner( options.writebackBandwidth, options.writebackMaxBatch, options.writebackHighWatermark, options.writebackLowWatermark );
+	Prefetcher prefetcher( options.prefetchMaxWindow );
+	LoadController controller( options.workingSetWindow, options.pffInterval, frameTable.maxPages );
+
+	if( cpuScheduler.empty() ){
+		Scheduler scheduler(processes, missPenalty, dirtyPagePenalty, options.cowPenalty, &MMU, options.writeback ? &cleaner : NULL, options.prefetch ? &prefetcher : NULL, 
+							options.loadControl ? &controller : NULL, hugePromoteThreshold, zswapSize > 0 ? &pool : NULL, options.zswapPenalty, 
+							numaNodes > 1 ? &topology : NULL, debug);
+		scheduler.run();
+	}
+	else{
+		CpuScheduler scheduler(processes, missPenalty, dirtyPagePenalty, options.cowPenalty, &MMU, options.writeback ? &cleaner : NULL, options.prefetch ? &prefetcher : NULL, 
+							   options.loadControl ? &controller : NULL, hugePromoteThreshold, zswapSize > 0 ? &pool : NULL, options.zswapPenalty, 
+							   numaNodes > 1 ? &topology : NULL, cpuScheduler == "ctss", options.ctssQueues, options.contextSwitchDelay, debug);
+		scheduler.run();
+		if( sweep ){
+			ostringstream label;
+			label << cpuScheduler << "\t" << PAbits;
+			scheduler.displaySummary( label.str() );
+			return;
+		}
+		scheduler.displayStats();
+	}
+	if( !options.sharedPages.empty() ){ MMU.displaySharingStats(); }
+}
+
+
+//Reads the text or binary reference file into processes
+void loadReferenceFile( string& referenceFileName, deque<Process*>& processes, int pageSize, int VAbits ){
+	ifstream referenceFile( referenceFileName.c_str() );
+	if( !referenceFile ){ cout << "Could not open reference file" << endl; exit(1); }
+	else if( isBinaryTraceFile(referenceFileName) ){ readBinaryReferenceFile(referenceFileName, processes, pageSize, VAbits); }
+	else{ readReferenceFile(referenceFile, processes, pageSize, VAbits); }
+}
+
+
+int main( int argc, char* argv[] ){
+
+	//Conversion mode: memoryManagement convert <text reference file> <binary reference file>
+	if( argc == 4 && string(argv[1]) == "convert" ){
+		string textFileName = argv[2], binaryFileName = argv[3];
+		return convertReferenceFile( textFileName, binaryFileName ) ? 0 : 1;
+	}
 
 	//Read information from memory management file
 	ifstream memManagementFile("MemoryManagement.txt");
 	string referenceFileName;
 	int missPenalty, dirtyPagePenalty, pageSize, VAbits, PAbits;
 	bool debug;
+	MemoryOptions options;
 
 	if( !memManagementFile ){ cout << "Could not open memory management file" << endl; exit(1); }
-	else{ readMemManagementFile( memManagementFile, referenceFileName, missPenalty, dirtyPagePenalty, pageSize, VAbits, PAbits, debug ); }
+	else{ readMemManagementFile( memManagementFile, referenceFileName, missPenalty, dirtyPagePenalty, pageSize, VAbits, PAbits, debug, options ); }
 
 
-	//Read information from reference file
-	ifstream referenceFile( referenceFileName.c_str() );
+	//Read information from reference file (text or binary trace)
 	deque<Process*> processes;
+	loadReferenceFile( referenceFileName, processes, pageSize, VAbits );
+
+	//Threaded mode shares one frame pool between worker threads. None of the single threaded options work with it
+	if( options.threads > 1 ){
+		string unsupported;
+		if( options.writeback ){ unsupported += " writeback"; }
+		if( options.prefetch ){ unsupported += " prefetch"; }
+		if( options.loadControl ){ unsupported += " loadControl"; }
+		if( !options.sharedPages.empty() ){ unsupported += " sharedPages"; }
+		if( options.hugePageSize > 0 ){ unsupported += " hugePageSize"; }
+		if( options.zswapSize > 0 ){ unsupported += " zswapSize"; }
+		if( options.numaNodes > 1 ){ unsupported += " numaNodes"; }
+		if( !options.cpuSchedulers.empty() ){ unsupported += " cpuScheduler"; }
+		if( !unsupported.empty() ){ cout << "Not supported with threads > 1:" << unsupported << endl; exit(1); }
+
+		ConcurrentClock sharedMMU( int( pow(2, PAbits)/pageSize ) );
+		ThreadedScheduler threadedScheduler( processes, missPenalty, dirtyPagePenalty, &sharedMMU, options.threads, options.deterministic, options.seed );
+		threadedScheduler.run();
+		return 0;
+	}
 
-	if( !referenceFile ){ cout << "Could not open reference file" << endl; exit(1); }
-	else{ readReferenceFile(referenceFile, processes, pageSize, VAbits); }
+	//Huge frames are found across all of memory, so they'd straddle node boundaries
+	if( options.hugePageSize > 0 && options.numaNodes > 1 ){ cout << "hugePageSize is not supported with numaNodes > 1" << endl; exit(1); }
 
-	PageTable frameTable = PageTable( pow(2, PAbits)/pageSize );
-	Clock MMU = Clock( &frameTable, debug );
-	Scheduler scheduler(processes, missPenalty, dirtyPagePenalty, &MMU, debug);
-	scheduler.run();
+	//Without a CPU scheduler it's just the memory scheduler
+	if( options.cpuSchedulers.empty() ){
+		runSimulation( processes, missPenalty, dirtyPagePenalty, pageSize, PAbits, debug, options, "", false );
+		return 0;
+	}
+
+	//A single combination gets the full report. Otherwise every CPU scheduler runs at every memory size, one row each
+	vector<int> sizes = options.sweepPAbits;
+	if( sizes.empty() ){ sizes.push_back( PAbits ); }
+	bool sweep = options.cpuSchedulers.size() * sizes.size() > 1;
+	if( sweep ){ cout << "Scheduler\tPAbits\tTime\tCPU %\tThroughput\tTurnaround\tReady wait\tFaults\tDirty evictions\tAvg fault latency" << endl; }
+	for( size_t i = 0; i < options.cpuSchedulers.size(); ++i ){
+		for( size_t j = 0; j < sizes.size(); ++j ){
+			if( i > 0 || j > 0 ){
+				for( size_t k = 0; k < processes.size(); ++k ){ delete processes[k]; }
+				processes.clear();
+				loadReferenceFile( referenceFileName, processes, pageSize, VAbits );
+			}
+			runSimulation( processes, missPenalty, dirtyPagePenalty, pageSize, sizes[j], debug, options, options.cpuSchedulers[i], sweep );
+		}
+	}
+	return 0;
 }
\ No newline at end of file